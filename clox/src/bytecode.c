@@ -0,0 +1,863 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "vm.h"
+
+#define BYTECODE_MAGIC "LOXC"
+// Bump it whenever the format or the instruction set changes.
+#define BYTECODE_VERSION 6
+
+// Images are written in the byte order of the machine, the mark tells
+// whether the reader's is the same.
+#define BYTE_ORDER_MARK 0x01020304
+
+// An image is made of the sections below, at offsets from its start, so it
+// can be mapped at any address. Offsets are aligned for the data they point
+// to.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t source_hash;
+    uint64_t size; // Size of the whole image
+    uint32_t byte_order; // BYTE_ORDER_MARK
+    
+    // Strings are ObjStrings, with the header imageStringHeader() returns,
+    // followed by their characters.
+    uint32_t string_size; // sizeof(ObjString)
+    uint32_t string_chars; // offsetof(ObjString, chars)
+    uint32_t string_count;
+    uint32_t strings; // uint32_t offsets of the strings
+    
+    uint32_t global_count;
+    uint32_t globals; // uint32_t string indices of the names of the globals
+    
+    uint32_t function_count;
+    uint32_t functions; // ImageFunctions, the script first
+} ImageHeader;
+
+typedef struct {
+    uint32_t arity;
+    uint32_t upvalue_count;
+    uint32_t stack_size;
+    uint32_t name; // String index, or UINT32_MAX for the script
+    uint32_t code; // Offset of the code
+    uint32_t code_count;
+    uint32_t lines; // Offset of the line numbers, as in Lines
+    uint32_t lengths; // Offset of the lengths of the line runs
+    uint32_t line_count;
+    uint32_t cache_count;
+    uint32_t constants; // Offset of the ImageConstants
+    uint32_t constant_count;
+} ImageFunction;
+
+typedef enum {
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION,
+    CONSTANT_CLASS,
+} ConstantTag;
+
+typedef struct {
+    uint32_t tag;
+    uint32_t index; // String index for strings and classes, function index for functions
+    uint64_t bits; // Bits of the double, for numbers
+} ImageConstant;
+
+// hashSource is FNV-1a, on 64 bits.
+static uint64_t hashSource(const char *source) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = source; *c != '\0'; c++) {
+        hash ^= (uint8_t) *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// The writer doesn't allocate through Reallocate(), so it never triggers a
+// GC cycle while the script isn't rooted.
+
+typedef struct {
+    uint8_t *data;
+    size_t count;
+    size_t capacity;
+} Buffer;
+
+#define AT(buffer, type, offset) ((type*) ((buffer)->data + (offset)))
+
+// reserve appends size zeroed bytes at the next offset with the given
+// alignment, a power of 2, and returns that offset.
+static size_t reserve(Buffer *buffer, size_t size, size_t alignment) {
+    size_t offset = (buffer->count + alignment - 1) & ~(alignment - 1);
+    if (offset + size > buffer->capacity) {
+        size_t capacity = GROW_CAPACITY(buffer->capacity);
+        while (capacity < offset + size) {
+            capacity *= 2;
+        }
+        buffer->data = realloc(buffer->data, capacity);
+        if (buffer->data == NULL) {
+            exit(1);
+        }
+        buffer->capacity = capacity;
+    }
+    
+    memset(buffer->data + buffer->count, 0, offset + size - buffer->count);
+    buffer->count = offset + size;
+    return offset;
+}
+
+// IndexMap numbers the objects written in an image, in the order they are
+// added.
+typedef struct {
+    int count;
+    int capacity; // 0 or a power of 2
+    Obj **objs;
+    int *slots; // Index of an object plus one, 0 for empty slots
+} IndexMap;
+
+static uint32_t hashPointer(Obj *obj) {
+    return (uint32_t) (((uintptr_t) obj >> 4) * 2654435761u);
+}
+
+static int *findSlot(IndexMap *map, Obj *obj) {
+    uint32_t mask = map->capacity - 1;
+    for (uint32_t i = hashPointer(obj) & mask;; i = (i + 1) & mask) {
+        if (map->slots[i] == 0 || map->objs[map->slots[i] - 1] == obj) {
+            return &map->slots[i];
+        }
+    }
+}
+
+static int indexOf(IndexMap *map, Obj *obj) {
+    return map->capacity > 0 ? *findSlot(map, obj) - 1 : -1;
+}
+
+// addObj adds obj to the map if it isn't there yet.
+static void addObj(IndexMap *map, Obj *obj) {
+    if (indexOf(map, obj) >= 0) {
+        return;
+    }
+    
+    if ((map->count + 1) * 2 > map->capacity) {
+        int capacity = map->capacity == 0 ? 16 : map->capacity * 2;
+        map->objs = realloc(map->objs, capacity * sizeof(Obj*));
+        map->slots = realloc(map->slots, capacity * sizeof(int));
+        if (map->objs == NULL || map->slots == NULL) {
+            exit(1);
+        }
+        memset(map->slots, 0, capacity * sizeof(int));
+        map->capacity = capacity;
+        for (int i = 0; i < map->count; i++) {
+            *findSlot(map, map->objs[i]) = i + 1;
+        }
+    }
+    
+    map->objs[map->count] = obj;
+    *findSlot(map, obj) = ++map->count;
+}
+
+static void freeIndexMap(IndexMap *map) {
+    free(map->objs);
+    free(map->slots);
+}
+
+// collectFunction numbers function and the functions nested in it, in
+// depth-first order, and the strings they use. Returns false if they hold a
+// constant that images can't.
+static bool collectFunction(IndexMap *functions, IndexMap *strings, ObjFunction *function) {
+    addObj(functions, (Obj*) function);
+    if (function->name != NULL) {
+        addObj(strings, (Obj*) function->name);
+    }
+    
+    ValueArray *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (!IsObj(constants->values[i])) {
+            continue;
+        }
+        
+        Obj *obj = AsObj(constants->values[i]);
+        switch (obj->type) {
+            case OBJ_STRING:
+                addObj(strings, obj);
+                break;
+            case OBJ_FUNCTION:
+                if (!collectFunction(functions, strings, (ObjFunction*) obj)) {
+                    return false;
+                }
+                break;
+            case OBJ_CLASS:
+                // Classes are only constants before they run, without methods.
+                addObj(strings, (Obj*) ((ObjClass*) obj)->name);
+                break;
+            default:
+                return false;
+        }
+    }
+    
+    return true;
+}
+
+static ImageConstant imageConstant(IndexMap *functions, IndexMap *strings, Value value) {
+    ImageConstant constant = {0};
+    if (IsNil(value)) {
+        constant.tag = CONSTANT_NIL;
+    } else if (IsBoolean(value)) {
+        constant.tag = AsBoolean(value) ? CONSTANT_TRUE : CONSTANT_FALSE;
+    } else if (IsNumber(value)) {
+        double number = AsNumber(value);
+        constant.tag = CONSTANT_NUMBER;
+        memcpy(&constant.bits, &number, sizeof(number));
+    } else {
+        Obj *obj = AsObj(value);
+        switch (obj->type) {
+            case OBJ_STRING:
+                constant.tag = CONSTANT_STRING;
+                constant.index = indexOf(strings, obj);
+                break;
+            case OBJ_FUNCTION:
+                constant.tag = CONSTANT_FUNCTION;
+                constant.index = indexOf(functions, obj);
+                break;
+            default:
+                constant.tag = CONSTANT_CLASS;
+                constant.index = indexOf(strings, (Obj*) ((ObjClass*) obj)->name);
+                break;
+        }
+    }
+    return constant;
+}
+
+// writeFunction writes the chunk of function, and its ImageFunction at
+// offset.
+static void writeFunction(Buffer *buffer, size_t offset, IndexMap *functions, IndexMap *strings, ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+    size_t code = reserve(buffer, chunk->count, 1);
+    memcpy(AT(buffer, uint8_t, code), chunk->code, chunk->count);
+    size_t lines = reserve(buffer, chunk->lines.count * sizeof(int), sizeof(int));
+    memcpy(AT(buffer, int, lines), chunk->lines.lines, chunk->lines.count * sizeof(int));
+    size_t lengths = reserve(buffer, chunk->lines.count * sizeof(int), sizeof(int));
+    memcpy(AT(buffer, int, lengths), chunk->lines.lengths, chunk->lines.count * sizeof(int));
+    
+    size_t constants = reserve(buffer, chunk->constants.count * sizeof(ImageConstant), 8);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        AT(buffer, ImageConstant, constants)[i] = imageConstant(functions, strings, chunk->constants.values[i]);
+    }
+    
+    ImageFunction *record = AT(buffer, ImageFunction, offset);
+    record->arity = function->arity;
+    record->upvalue_count = function->upvalue_count;
+    record->stack_size = function->stack_size;
+    record->name = function->name != NULL ? (uint32_t) indexOf(strings, (Obj*) function->name) : UINT32_MAX;
+    record->code = code;
+    record->code_count = chunk->count;
+    record->lines = lines;
+    record->lengths = lengths;
+    record->line_count = chunk->lines.count;
+    record->cache_count = chunk->cache_count;
+    record->constants = constants;
+    record->constant_count = chunk->constants.count;
+}
+
+// imageStringHeader returns the header of a string of the image, written
+// complete so that loading the image never writes to it. The string is
+// immortal, interned, and stays marked and old so that the GC, which only
+// sweeps the objects it allocated, leaves it alone.
+static ObjString imageStringHeader(size_t length, uint32_t hash) {
+    ObjString header;
+    memset(&header, 0, sizeof(header)); // The padding too, see imageString()
+    header.obj.type = OBJ_STRING;
+    header.obj.refcount = 0;
+    header.obj.zct_index = -1;
+    header.obj.marked = true;
+    header.obj.old = true;
+    header.obj.remembered_index = -1;
+    header.obj.age = 0;
+    header.obj.immortal = true;
+    header.length = length;
+    header.hash = hash;
+    header.interned = true;
+    return header;
+}
+
+// writeString writes string and returns its offset.
+static size_t writeString(Buffer *buffer, ObjString *string) {
+    size_t chars = offsetof(ObjString, chars);
+    size_t offset = reserve(buffer, chars + string->length + 1, 8);
+    
+    ObjString header = imageStringHeader(string->length, StringHash(string));
+    memcpy(AT(buffer, uint8_t, offset), &header, chars);
+    memcpy(AT(buffer, uint8_t, offset + chars), string->chars, string->length + 1);
+    
+    return offset;
+}
+
+// buildImage lays out the image of script in buffer. Returns false if script
+// can't be written in an image.
+static bool buildImage(Buffer *buffer, ObjFunction *script, const char *source) {
+    IndexMap functions = {0};
+    IndexMap strings = {0};
+    bool ok = collectFunction(&functions, &strings, script);
+    for (int i = 0; i < vm.global_count; i++) {
+        addObj(&strings, (Obj*) vm.globals[i].name);
+    }
+    
+    size_t header = reserve(buffer, sizeof(ImageHeader), 8);
+    size_t function_records = reserve(buffer, functions.count * sizeof(ImageFunction), 8);
+    for (int i = 0; ok && i < functions.count; i++) {
+        writeFunction(buffer, function_records + i * sizeof(ImageFunction), &functions, &strings, (ObjFunction*) functions.objs[i]);
+    }
+    
+    size_t globals = reserve(buffer, vm.global_count * sizeof(uint32_t), sizeof(uint32_t));
+    for (int i = 0; i < vm.global_count; i++) {
+        AT(buffer, uint32_t, globals)[i] = indexOf(&strings, (Obj*) vm.globals[i].name);
+    }
+    
+    size_t string_offsets = reserve(buffer, strings.count * sizeof(uint32_t), sizeof(uint32_t));
+    for (int i = 0; i < strings.count; i++) {
+        size_t offset = writeString(buffer, (ObjString*) strings.objs[i]);
+        AT(buffer, uint32_t, string_offsets)[i] = offset;
+    }
+    
+    ImageHeader *image = AT(buffer, ImageHeader, header);
+    memcpy(image->magic, BYTECODE_MAGIC, sizeof(image->magic));
+    image->version = BYTECODE_VERSION;
+    image->source_hash = hashSource(source);
+    image->size = buffer->count;
+    image->byte_order = BYTE_ORDER_MARK;
+    image->string_size = sizeof(ObjString);
+    image->string_chars = offsetof(ObjString, chars);
+    image->string_count = strings.count;
+    image->strings = string_offsets;
+    image->global_count = vm.global_count;
+    image->globals = globals;
+    image->function_count = functions.count;
+    image->functions = function_records;
+    
+    freeIndexMap(&functions);
+    freeIndexMap(&strings);
+    
+    // Offsets are 32-bit.
+    return ok && buffer->count <= UINT32_MAX;
+}
+
+bool WriteBytecode(const char *path, ObjFunction *script, const char *source) {
+    Buffer buffer = {0};
+    if (!buildImage(&buffer, script, source)) {
+        free(buffer.data);
+        return false;
+    }
+    
+    // The file is written under a temporary name and renamed once complete,
+    // so that other runs never read a partial file.
+    size_t tmp_path_size = strlen(path) + 32;
+    char *tmp_path = malloc(tmp_path_size);
+    if (tmp_path == NULL) {
+        free(buffer.data);
+        return false;
+    }
+    snprintf(tmp_path, tmp_path_size, "%s.%ld.tmp", path, (long) getpid());
+    
+    FILE *file = fopen(tmp_path, "wb");
+    bool ok = file != NULL;
+    if (ok) {
+        ok = fwrite(buffer.data, 1, buffer.count, file) == buffer.count;
+        ok = fclose(file) == 0 && ok;
+        ok = ok && rename(tmp_path, path) == 0;
+        if (!ok) {
+            remove(tmp_path);
+        }
+    }
+    
+    free(tmp_path);
+    free(buffer.data);
+    return ok;
+}
+
+typedef struct {
+    uint8_t *base;
+    size_t size;
+    ImageHeader *header;
+    ImageFunction *functions;
+    uint32_t *string_offsets;
+    ObjString **strings; // Strings already resolved by imageString(), or NULL
+    bool *loaded; // Functions already loaded by loadFunction()
+} Loader;
+
+// within tells whether count elements of the given size and alignment fit in
+// the image at offset.
+static bool within(Loader *loader, uint64_t offset, uint64_t count, uint64_t size, uint64_t alignment) {
+    return offset % alignment == 0 && offset <= loader->size && count * size <= loader->size - offset;
+}
+
+// imageString returns the string with the given index in the image, or NULL
+// if it's invalid. Strings that are already interned are reused, the others
+// are interned in place, without writing to the image. It may trigger a GC
+// cycle.
+static ObjString *imageString(Loader *loader, uint32_t index) {
+    if (index >= loader->header->string_count) {
+        return NULL;
+    }
+    if (loader->strings[index] != NULL) {
+        return loader->strings[index];
+    }
+    
+    uint32_t offset = loader->string_offsets[index];
+    size_t chars = offsetof(ObjString, chars);
+    if (!within(loader, offset, 1, chars, 8)) {
+        return NULL;
+    }
+    ObjString *string = (ObjString*) (loader->base + offset);
+    if (string->length >= loader->size - offset - chars || string->chars[string->length] != '\0') {
+        return NULL;
+    }
+    // A header the VM would write to, e.g. an unmarked one, would fault.
+    ObjString header = imageStringHeader(string->length, string->hash);
+    if (string->hash == 0 || memcmp(&header, string, chars) != 0) {
+        return NULL;
+    }
+    
+    ObjString *interned = FindString(&vm.strings, string);
+    if (interned != NULL) {
+        // The string table doesn't keep it alive, the caller will.
+        ShadeObj((Obj*) interned);
+        loader->strings[index] = interned;
+        return interned;
+    }
+    
+    AddString(&vm.strings, string);
+    
+    loader->strings[index] = string;
+    return string;
+}
+
+static ObjFunction *loadFunction(Loader *loader, uint32_t index);
+
+// loadConstant returns the constant, or sets error if it's invalid. It may
+// trigger a GC cycle.
+static Value loadConstant(Loader *loader, uint32_t function_index, ImageConstant *constant, bool *error) {
+    switch (constant->tag) {
+        case CONSTANT_NIL:
+            return FromNil();
+        case CONSTANT_FALSE:
+            return FromBoolean(false);
+        case CONSTANT_TRUE:
+            return FromBoolean(true);
+        case CONSTANT_NUMBER: {
+            double number;
+            memcpy(&number, &constant->bits, sizeof(number));
+            return FromDouble(number);
+        }
+        case CONSTANT_STRING: {
+            ObjString *string = imageString(loader, constant->index);
+            if (string != NULL) {
+                return FromObj((Obj*) string);
+            }
+            break;
+        }
+        case CONSTANT_FUNCTION: {
+            // Nested functions come after the function nesting them, which
+            // rules out cycles.
+            ObjFunction *function = constant->index > function_index ? loadFunction(loader, constant->index) : NULL;
+            if (function != NULL) {
+                return FromObj((Obj*) function);
+            }
+            break;
+        }
+        case CONSTANT_CLASS: {
+            ObjString *name = imageString(loader, constant->index);
+            if (name == NULL) {
+                break;
+            }
+            Push(FromObj((Obj*) name)); // NewClass() may trigger a GC cycle
+            ObjClass *class = NewClass(name);
+            Pop(); // name
+            return FromObj((Obj*) class);
+        }
+    }
+    
+    *error = true;
+    return FromNil();
+}
+
+// loadFunction materialises the function with the given index, whose code
+// and lines stay in the image. Returns NULL if the image is invalid. The code
+// itself is only checked when the function is first called, see
+// LinkFunction(). It may trigger a GC cycle.
+static ObjFunction *loadFunction(Loader *loader, uint32_t index) {
+    if (index >= loader->header->function_count || loader->loaded[index]) {
+        return NULL;
+    }
+    loader->loaded[index] = true;
+    
+    ImageFunction *record = &loader->functions[index];
+    // No instruction grows the stack by more than one value.
+    if (record->arity > UINT8_MAX || record->upvalue_count > UINT8_MAX + 1 ||
+        record->cache_count > UINT16_MAX + 1 || record->code_count > INT_MAX ||
+        record->stack_size < 1 + record->arity ||
+        record->stack_size > 1 + record->arity + (uint64_t) record->code_count ||
+        !within(loader, record->code, record->code_count, 1, 1) ||
+        !within(loader, record->lines, record->line_count, sizeof(int), sizeof(int)) ||
+        !within(loader, record->lengths, record->line_count, sizeof(int), sizeof(int)) ||
+        !within(loader, record->constants, record->constant_count, sizeof(ImageConstant), 8)) {
+        return NULL;
+    }
+    
+    ObjFunction *function = NewFunction();
+    Push(FromObj((Obj*) function)); // Loading its contents may trigger a GC cycle
+    
+    function->arity = (int) record->arity;
+    function->upvalue_count = (int) record->upvalue_count;
+    function->stack_size = (int) record->stack_size;
+    function->linked = false;
+    
+    Chunk *chunk = &function->chunk;
+    chunk->code_mapped = true;
+    chunk->lines_mapped = true;
+    chunk->code = loader->base + record->code;
+    chunk->count = chunk->capacity = (int) record->code_count;
+    chunk->lines.lines = (int*) (loader->base + record->lines);
+    chunk->lines.lengths = (int*) (loader->base + record->lengths);
+    chunk->lines.count = chunk->lines.capacity = (int) record->line_count;
+    for (uint32_t i = 0; i < record->cache_count; i++) {
+        AddInlineCache(chunk);
+    }
+    
+    bool error = false;
+    if (record->name != UINT32_MAX) {
+        ObjString *name = imageString(loader, record->name);
+        if (name != NULL) {
+            function->name = name; IncrementRefcountObject((Obj*) name);
+            WriteBarrier((Obj*) function, FromObj((Obj*) name));
+        } else {
+            error = true;
+        }
+    }
+    
+    ImageConstant *constants = (ImageConstant*) (loader->base + record->constants);
+    for (uint32_t i = 0; i < record->constant_count && !error; i++) {
+        Value value = loadConstant(loader, index, &constants[i], &error);
+        if (error) {
+            break;
+        }
+        
+        Push(value); // WriteValueArray() may trigger a GC cycle
+        IncrementRefcountValue(value);
+        WriteValueArray(&chunk->constants, value);
+        WriteBarrier((Obj*) function, value);
+        Pop(); // value
+    }
+    
+    Pop(); // function
+    
+    return error ? NULL : function;
+}
+
+// decodeCode checks that every instruction of function is known, fits in its
+// code and only refers to constants, inline caches, globals and upvalues that
+// exist. It records in starts the offsets at which instructions start. It also
+// maps the slots of globals in the code from the ones they had when the image
+// was written to their slots in this VM. They are usually the same, and the
+// code is only copied out of the image to be rewritten when they aren't. It
+// may trigger a GC cycle.
+static bool decodeCode(ObjFunction *function, int *slots, int slot_count, bool *starts) {
+    Chunk *chunk = &function->chunk;
+    
+    int64_t line_bytes = 0;
+    for (int i = 0; i < chunk->lines.count; i++) {
+        line_bytes += chunk->lines.lengths[i];
+    }
+    if (line_bytes != chunk->count) {
+        return false;
+    }
+    
+    int offset = 0;
+    int last = -1;
+    while (offset < chunk->count) {
+        uint8_t *code = &chunk->code[offset];
+        int left = chunk->count - offset;
+        // The compiler never emits quickened instructions, and the VM doesn't
+        // deoptimise code in the image, see QUICKEN().
+        if (code[0] >= OP_ADD_NUM) {
+            return false;
+        }
+        
+        int constant = -1;
+        int cache = -1;
+        switch (code[0]) {
+            case OP_CONSTANT:
+            case OP_CLOSURE:
+            case OP_IDENT_PROPERTY:
+            case OP_INVOKE:
+            case OP_TAIL_INVOKE:
+                constant = left >= 2 ? code[1] : INT32_MAX;
+                break;
+            case OP_CONSTANT_LONG:
+            case OP_CLOSURE_LONG:
+            case OP_IDENT_PROPERTY_LONG:
+            case OP_INVOKE_LONG:
+            case OP_TAIL_INVOKE_LONG:
+                constant = left >= 4 ? code[1] | code[2] << 8 | code[3] << 16 : INT32_MAX;
+                break;
+        }
+        if (constant >= chunk->constants.count) {
+            return false;
+        }
+        if ((code[0] == OP_CLOSURE || code[0] == OP_CLOSURE_LONG) && !IsFunction(chunk->constants.values[constant])) {
+            return false;
+        }
+        
+        int length = InstructionLength(chunk, offset);
+        if (length > left) {
+            return false;
+        }
+        
+        switch (code[0]) {
+            case OP_VAR_DECL:
+            case OP_IDENT_GLOBAL:
+            case OP_ASSIGN_GLOBAL: {
+                int slot = code[1] | code[2] << 8;
+                if (slot >= slot_count || slots[slot] > UINT16_MAX) {
+                    return false;
+                }
+                if (slots[slot] != slot) {
+                    if (chunk->code_mapped) {
+                        UnmapCode(chunk);
+                        code = &chunk->code[offset];
+                    }
+                    code[1] = slots[slot] & 0xFF;
+                    code[2] = (slots[slot] >> 8) & 0xFF;
+                }
+                break;
+            }
+            case OP_IDENT_UPVALUE:
+            case OP_ASSIGN_UPVALUE:
+                if (code[1] >= function->upvalue_count) {
+                    return false;
+                }
+                break;
+            case OP_IDENT_PROPERTY:
+                cache = code[2] | code[3] << 8;
+                break;
+            case OP_IDENT_PROPERTY_LONG:
+                cache = code[4] | code[5] << 8;
+                break;
+            case OP_INVOKE:
+            case OP_TAIL_INVOKE:
+                cache = code[3] | code[4] << 8;
+                break;
+            case OP_INVOKE_LONG:
+            case OP_TAIL_INVOKE_LONG:
+                cache = code[5] | code[6] << 8;
+                break;
+        }
+        if (cache >= chunk->cache_count) {
+            return false;
+        }
+        
+        starts[offset] = true;
+        last = offset;
+        offset += length;
+    }
+    
+    // Running past the end of the code would read whatever follows it.
+    return last >= 0 && (chunk->code[last] == OP_RETURN || chunk->code[last] == OP_JUMP);
+}
+
+// checkJumps checks that every jump of chunk lands on an instruction, so
+// that MaxStackDepth() and the VM decode the same instructions as decodeCode().
+static bool checkJumps(Chunk *chunk, bool *starts) {
+    for (int offset = 0; offset < chunk->count; offset += InstructionLength(chunk, offset)) {
+        uint8_t *code = &chunk->code[offset];
+        if (code[0] == OP_JUMP || code[0] == OP_JUMP_IF_FALSE || code[0] == OP_JUMP_IF_TRUE) {
+            int destination = offset + 3 + (int16_t) (code[1] | code[2] << 8);
+            if (destination < 0 || destination >= chunk->count || !starts[destination]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// checkSlots checks that the locals used by the code of function, and those
+// its closures capture, are within its frame, and that the upvalues its
+// closures capture exist.
+static bool checkSlots(ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count; offset += InstructionLength(chunk, offset)) {
+        uint8_t *code = &chunk->code[offset];
+        switch (code[0]) {
+            case OP_IDENT_LOCAL:
+            case OP_ASSIGN_LOCAL:
+                if (code[1] >= function->stack_size) {
+                    return false;
+                }
+                break;
+            case OP_CLOSURE:
+            case OP_CLOSURE_LONG: {
+                int length = InstructionLength(chunk, offset);
+                for (int i = code[0] == OP_CLOSURE ? 2 : 4; i < length; i += 2) {
+                    bool is_local = code[i] == 1;
+                    if (code[i] > 1 || code[i + 1] >= (is_local ? function->stack_size : function->upvalue_count)) {
+                        return false;
+                    }
+                }
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+bool LinkFunction(ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+    
+    bool *starts = calloc(chunk->count + 1, sizeof(bool));
+    if (starts == NULL) {
+        exit(1);
+    }
+    bool valid = decodeCode(function, vm.image_slots, vm.image_slot_count, starts) && checkJumps(chunk, starts);
+    free(starts);
+    if (!valid) {
+        return false;
+    }
+    
+    // The frame is sized by the stack size of the image, which must leave
+    // room for the deepest point of the code.
+    int depth = MaxStackDepth(chunk);
+    if (depth < 0 || 1 + function->arity + depth > function->stack_size || !checkSlots(function)) {
+        return false;
+    }
+    
+    function->linked = true;
+    return true;
+}
+
+// mapImage maps the file at path read-only, so that its pages are shared
+// through the page cache by every process running the script. Code the VM
+// writes to is copied out of it first, see UnmapCode().
+static uint8_t *mapImage(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    
+    struct stat st;
+    uint8_t *base = NULL;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(ImageHeader)) {
+        void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            base = mapping;
+            *size = st.st_size;
+        }
+    }
+    
+    close(fd);
+    return base;
+}
+
+static bool validHeader(Loader *loader, const char *source) {
+    ImageHeader *header = loader->header;
+    return memcmp(header->magic, BYTECODE_MAGIC, sizeof(header->magic)) == 0 &&
+        header->version == BYTECODE_VERSION &&
+        header->source_hash == hashSource(source) &&
+        header->size == loader->size &&
+        header->byte_order == BYTE_ORDER_MARK &&
+        header->string_size == sizeof(ObjString) &&
+        header->string_chars == offsetof(ObjString, chars) &&
+        within(loader, header->strings, header->string_count, sizeof(uint32_t), sizeof(uint32_t)) &&
+        within(loader, header->globals, header->global_count, sizeof(uint32_t), sizeof(uint32_t)) &&
+        within(loader, header->functions, header->function_count, sizeof(ImageFunction), 8) &&
+        header->function_count > 0;
+}
+
+ObjFunction *ReadBytecode(const char *path, const char *source) {
+    if (vm.image != NULL) {
+        return NULL;
+    }
+    
+    size_t size;
+    uint8_t *base = mapImage(path, &size);
+    if (base == NULL) {
+        return NULL;
+    }
+    
+    Loader loader = {.base = base, .size = size, .header = (ImageHeader*) base};
+    if (!validHeader(&loader, source)) {
+        munmap(base, size);
+        return NULL;
+    }
+    
+    // From now on strings of the image may be interned, so it stays mapped
+    // even if it turns out to be invalid.
+    vm.image = base;
+    vm.image_size = size;
+    
+    ImageHeader *header = loader.header;
+    loader.functions = (ImageFunction*) (base + header->functions);
+    loader.string_offsets = (uint32_t*) (base + header->strings);
+    loader.strings = calloc(header->string_count + 1, sizeof(ObjString*));
+    loader.loaded = calloc(header->function_count, sizeof(bool));
+    if (loader.strings == NULL || loader.loaded == NULL) {
+        exit(1);
+    }
+    // The slots of the globals are needed until every function is linked.
+    int *slots = ALLOCATE(int, header->global_count);
+    vm.image_slots = slots;
+    vm.image_slot_count = (int) header->global_count;
+    
+    bool ok = true;
+    uint32_t *globals = (uint32_t*) (base + header->globals);
+    for (uint32_t i = 0; i < header->global_count && ok; i++) {
+        ObjString *name = imageString(&loader, globals[i]);
+        ok = name != NULL;
+        if (ok) {
+            slots[i] = GlobalSlot(name);
+        }
+    }
+    
+    ObjFunction *script = ok ? loadFunction(&loader, 0) : NULL;
+    if (script != NULL) {
+        // The script is about to run, so it's linked now: an invalid one is
+        // compiled again rather than failing at runtime.
+        Push(FromObj((Obj*) script)); // LinkFunction() may trigger a GC cycle
+        bool linked = LinkFunction(script);
+        Pop(); // script
+        if (!linked) {
+            script = NULL;
+        }
+    }
+    if (script != NULL) {
+        IncrementRefcountObject((Obj*) script);
+    }
+    
+    free(loader.strings);
+    free(loader.loaded);
+    
+    return script;
+}
+
+void FreeBytecodeImage() {
+    if (vm.image == NULL) {
+        return;
+    }
+    
+    munmap(vm.image, vm.image_size);
+    vm.image = NULL;
+    vm.image_size = 0;
+    FREE_ARRAY(int, vm.image_slots, vm.image_slot_count);
+    vm.image_slots = NULL;
+    vm.image_slot_count = 0;
+}
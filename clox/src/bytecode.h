@@ -0,0 +1,46 @@
+#ifndef clox_bytecode_h
+#define clox_bytecode_h
+
+#include "common.h"
+#include "object.h"
+
+// Bytecode files (.loxc) are images of a compiled script, so that running it
+// again skips the scanner and the compiler. They hold the tree of functions
+// with the code, lines and constants of their chunks, and the names of the
+// globals, which the code refers to by slot. A hash of the source they were
+// compiled from tells whether they are still fresh.
+//
+// Images are mapped in memory rather than read. They only contain offsets,
+// so they can be mapped anywhere, and the code, the lines and the strings of
+// the script are used where they are in the mapping. Only the functions,
+// their constant tables and inline caches, and the classes are allocated on
+// load. The mapping is read-only and shared between the processes running the
+// script: strings are stored with their complete header, and the VM doesn't
+// quicken code in the image. The code of a function is only copied out of it
+// if the globals it refers to have different slots in this VM.
+//
+// Bytecode files are trusted: they are checked for consistency, not for
+// malicious code. The code of a function, which is most of the image, is
+// only checked the first time the function is called, so loading doesn't
+// read the code of the functions that don't run.
+
+// WriteBytecode writes script, compiled from source, to the file at path.
+// Returns false if it couldn't.
+bool WriteBytecode(const char *path, ObjFunction *script, const char *source);
+
+// ReadBytecode reads the script compiled from source from the file at path.
+// Returns NULL if the file is missing, stale, or not a valid bytecode file
+// for this version of clox. Like Compile(), it returns the script with a
+// refcount of 1.
+ObjFunction *ReadBytecode(const char *path, const char *source);
+
+// LinkFunction checks the code of a function of the image before the VM runs
+// it for the first time, and maps the slots of the globals it refers to.
+// Returns false if the code is invalid. It may trigger a GC cycle.
+bool LinkFunction(ObjFunction *function);
+
+// FreeBytecodeImage unmaps the image ReadBytecode() mapped, if any. Objects
+// point into it until they are all freed, by FreeVM().
+void FreeBytecodeImage();
+
+#endif
@@ -1,29 +1,141 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 
-static int addConstant(Chunk *chunk, Value value);
+static int addConstant(Chunk *chunk, ConstantMap *map, Value value);
 static void writeConstantSimple(Chunk *chunk, OpCode op, int offset, int line);
 static void writeConstantLong(Chunk *chunk, OpCode op, int offset, int line);
 
+void InitConstantMap(ConstantMap *map) {
+    map->count = 0;
+    map->capacity = 0;
+    map->slots = NULL;
+}
+
+void FreeConstantMap(ConstantMap *map) {
+    FREE_ARRAY(int, map->slots, map->capacity);
+    InitConstantMap(map);
+}
+
+// Constants are told apart by their bits: 0 and -0 are equal numbers but
+// different constants. Strings made by the compiler are interned, so
+// objects are compared by address.
+static uint64_t constantBits(Value value) {
+    uint64_t bits = 0;
+    if (IsNumber(value)) {
+        double number = AsNumber(value);
+        memcpy(&bits, &number, sizeof(number));
+    } else if (IsObj(value)) {
+        bits = (uint64_t) (uintptr_t) AsObj(value);
+    } else if (IsBoolean(value)) {
+        bits = AsBoolean(value);
+    }
+    return bits;
+}
+
+static bool sameConstant(Value a, Value b) {
+    if (IsNumber(a) != IsNumber(b) || IsObj(a) != IsObj(b) ||
+        IsBoolean(a) != IsBoolean(b) || IsNil(a) != IsNil(b)) {
+        return false;
+    }
+    return constantBits(a) == constantBits(b);
+}
+
+static size_t hashConstant(Value value) {
+    uint64_t hash = constantBits(value);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return (size_t) hash;
+}
+
+// findConstant returns the slot of map holding the index of value, or the
+// empty slot where it would go.
+static int *findConstant(ConstantMap *map, ValueArray *constants, Value value) {
+    size_t i = hashConstant(value) & (map->capacity - 1);
+    for (;;) {
+        int *slot = &map->slots[i];
+        if (*slot == 0 || sameConstant(constants->values[*slot - 1], value)) {
+            return slot;
+        }
+        i = (i + 1) & (map->capacity - 1);
+    }
+}
+
+static void growConstantMap(ConstantMap *map, ValueArray *constants) {
+    int cur_cap = map->capacity;
+    int *cur_slots = map->slots;
+    
+    map->capacity = GROW_CAPACITY(cur_cap);
+    map->slots = ALLOCATE(int, map->capacity);
+    memset(map->slots, 0, map->capacity * sizeof(int));
+    for (int i = 0; i < cur_cap; i++) {
+        if (cur_slots[i] != 0) {
+            *findConstant(map, constants, constants->values[cur_slots[i] - 1]) = cur_slots[i];
+        }
+    }
+    
+    FREE_ARRAY(int, cur_slots, cur_cap);
+}
+
 void InitChunk(Chunk *chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->code_mapped = false;
+    chunk->lines_mapped = false;
     InitLines(&chunk->lines);
     InitValueArray(&chunk->constants);
+    chunk->cache_count = 0;
+    chunk->cache_capacity = 0;
+    chunk->caches = NULL;
 }
 
 void FreeChunk(Chunk *chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FreeLines(&chunk->lines);
+    if (!chunk->code_mapped) {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    }
+    if (!chunk->lines_mapped) {
+        FreeLines(&chunk->lines);
+    }
     FreeValueArray(&chunk->constants);
+    for (int i = 0; i < chunk->cache_count; i++) {
+        for (int j = 0; j < INLINE_CACHE_WAYS; j++) {
+            InlineCacheEntry *entry = &chunk->caches[i].entries[j];
+            if (entry->class != NULL) {
+                DecrementRefcountObject((Obj*) entry->class);
+                DecrementRefcountShape(entry->shape);
+                DecrementRefcountValue(entry->method);
+            }
+        }
+    }
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cache_capacity);
     InitChunk(chunk);
 }
 
+void UnmapCode(Chunk *chunk) {
+    uint8_t *code = ALLOCATE(uint8_t, chunk->count);
+    memcpy(code, chunk->code, chunk->count);
+    chunk->code = code;
+    chunk->capacity = chunk->count;
+    chunk->code_mapped = false;
+}
+
 void MarkChunk(Chunk *chunk) {
     MarkValueArray(&chunk->constants);
+    for (int i = 0; i < chunk->cache_count; i++) {
+        for (int j = 0; j < INLINE_CACHE_WAYS; j++) {
+            InlineCacheEntry *entry = &chunk->caches[i].entries[j];
+            if (entry->class != NULL) {
+                MarkObj((Obj*) entry->class);
+                MarkShape(entry->shape);
+                MarkValue(entry->method);
+            }
+        }
+    }
 }
 
 void WriteChunk(Chunk *chunk, uint8_t byte, int line) {
@@ -37,10 +149,13 @@ void WriteChunk(Chunk *chunk, uint8_t byte, int line) {
     chunk->count++;
 }
 
-void WriteConstant(Chunk *chunk, OpCode op_simple, OpCode op_long, Value value, int line) {
-    IncrementRefcountValue(value);
-    
-    int offset = addConstant(chunk, value);
+void TruncateChunk(Chunk *chunk, int count) {
+    PopLines(&chunk->lines, chunk->count - count);
+    chunk->count = count;
+}
+
+void WriteConstant(Chunk *chunk, ConstantMap *map, OpCode op_simple, OpCode op_long, Value value, int line) {
+    int offset = addConstant(chunk, map, value);
     
     if (offset > 0xFF) {
         writeConstantLong(chunk, op_long, offset, line);
@@ -50,12 +165,88 @@ void WriteConstant(Chunk *chunk, OpCode op_simple, OpCode op_long, Value value,
     writeConstantSimple(chunk, op_simple, offset, line);
 }
 
+int AddInlineCache(Chunk *chunk) {
+    if (chunk->cache_count == chunk->cache_capacity) {
+        int capacity = GROW_CAPACITY(chunk->cache_capacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, chunk->cache_capacity, capacity);
+        chunk->cache_capacity = capacity;
+    }
+    
+    InlineCache *cache = &chunk->caches[chunk->cache_count];
+    for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+        cache->entries[i].class = NULL;
+        cache->entries[i].shape = NULL;
+        cache->entries[i].version = 0;
+        cache->entries[i].field = -1;
+        cache->entries[i].method = FromNil();
+    }
+    cache->next = 0;
+    
+    return chunk->cache_count++;
+}
+
+int InstructionLength(Chunk *chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_POPN:
+        case OP_IDENT_LOCAL:
+        case OP_ASSIGN_LOCAL:
+        case OP_IDENT_UPVALUE:
+        case OP_ASSIGN_UPVALUE:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return 2;
+        case OP_VAR_DECL:
+        case OP_IDENT_GLOBAL:
+        case OP_ASSIGN_GLOBAL:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP:
+            return 3;
+        case OP_CONSTANT_LONG:
+        case OP_IDENT_PROPERTY:
+            return 4;
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            return 5;
+        case OP_IDENT_PROPERTY_LONG:
+            return 6;
+        case OP_INVOKE_LONG:
+        case OP_TAIL_INVOKE_LONG:
+            return 7;
+        case OP_CLOSURE: {
+            ObjFunction *function = (ObjFunction*) AsObj(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + 2 * function->upvalue_count;
+        }
+        case OP_CLOSURE_LONG: {
+            int constant = chunk->code[offset + 1] | chunk->code[offset + 2] << 8 | chunk->code[offset + 3] << 16;
+            ObjFunction *function = (ObjFunction*) AsObj(chunk->constants.values[constant]);
+            return 4 + 2 * function->upvalue_count;
+        }
+        default:
+            return 1;
+    }
+}
+
 int GetLine(Chunk *chunk, int offset) {
     return GetLineAtOffset(&chunk->lines, offset);
 }
 
-static int addConstant(Chunk *chunk, Value value) {
+static int addConstant(Chunk *chunk, ConstantMap *map, Value value) {
+    // Load factor alpha = 50%
+    if (2 * (map->count + 1) > map->capacity) {
+        growConstantMap(map, &chunk->constants);
+    }
+    
+    int *slot = findConstant(map, &chunk->constants, value);
+    if (*slot != 0) {
+        return *slot - 1;
+    }
+    
+    IncrementRefcountValue(value);
     WriteValueArray(&chunk->constants, value);
+    *slot = chunk->constants.count;
+    map->count++;
     return chunk->constants.count - 1;
 }
 
@@ -27,44 +27,123 @@ typedef enum {
   OP_PRINT,
   OP_POP, // Expression statement. Simply pops the element at the top of the stack.
   OP_POPN, // Pops a variable number of elements from the top of the stack.
-  OP_VAR_DECL,
-  OP_IDENT_GLOBAL,
-  OP_ASSIGN_GLOBAL,
+  OP_VAR_DECL, // Defines a global variable. Operand: the slot of the variable (2B).
+  OP_IDENT_GLOBAL, // Operand: the slot of the variable (2B).
+  OP_ASSIGN_GLOBAL, // Operand: the slot of the variable (2B).
   OP_IDENT_LOCAL,
   OP_ASSIGN_LOCAL,
-  OP_IDENT_PROPERTY,
+  OP_IDENT_PROPERTY, // Operands: the property name (1B constant), the inline cache (2B).
+  OP_IDENT_PROPERTY_LONG, // Same as OP_IDENT_PROPERTY, with a 3B constant.
   OP_ASSIGN_PROPERTY,
   OP_IDENT_UPVALUE,
   OP_ASSIGN_UPVALUE,
   OP_CLOSE_UPVALUE,
   OP_JUMP_IF_FALSE, // Jumps if top of the stack is falsey. It has one 2B operand, the offset to move ip.
   OP_JUMP, // Jumps unconditionally. It has one 2B operand, the offset to move ip. 
+  OP_JUMP_IF_TRUE, // Like OP_JUMP_IF_FALSE, for truthy values. Only emitted by OptimizeChunk().
   OP_DUPLICATE, // Duplicates the value at the top of the stack
   OP_CALL,
-  OP_INVOKE,
-  OP_INVOKE_LONG,
+  OP_TAIL_CALL, // Same as OP_CALL, for a call whose result is returned. An OP_RETURN follows it.
+  OP_INVOKE, // Operands: the method name (1B constant), argc (1B), the inline cache (2B).
+  OP_INVOKE_LONG, // Same as OP_INVOKE, with a 3B constant.
+  OP_TAIL_INVOKE, // Same as OP_INVOKE, for a call whose result is returned. An OP_RETURN follows it.
+  OP_TAIL_INVOKE_LONG, // Same as OP_TAIL_INVOKE, with a 3B constant.
   OP_CLOSURE,
   OP_CLOSURE_LONG,
   OP_METHOD,
   OP_INHERIT,
   OP_GET_SUPER,
+  
+  // Quickened variants of the arithmetic and comparison opcodes, specialised
+  // for number operands. The compiler never emits them: the VM rewrites the
+  // generic opcode in place once it has seen numbers, and rewrites it back
+  // (deoptimises) when the operands stop being numbers.
+  OP_ADD_NUM,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_LESS_NUM,
+  OP_LESS_EQ_NUM,
+  OP_GREATER_NUM,
+  OP_GREATER_EQ_NUM,
 } OpCode;
 
+struct ObjClass;
+struct Shape;
+
+// Number of receiver classes an inline cache remembers.
+#define INLINE_CACHE_WAYS 4
+
+typedef struct {
+    struct ObjClass *class; // NULL iff the entry is unused
+    struct Shape *shape;
+    int version; // class->version when the entry was filled
+    
+    // Slot of the property in instances with the given shape, or -1 if the
+    // property is a method of the class.
+    int field;
+    Value method;
+} InlineCacheEntry;
+
+// InlineCache remembers the result of the property lookups done by a single
+// OP_IDENT_PROPERTY or OP_INVOKE instruction, keyed by the receiver's class
+// and shape.
+typedef struct {
+    InlineCacheEntry entries[INLINE_CACHE_WAYS];
+    int next; // Entry evicted by the next miss once all the entries are used
+} InlineCache;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
     Lines lines;
     ValueArray constants;
+    
+    // Whether code and lines point into a bytecode image (see bytecode.h),
+    // rather than being owned by the chunk. The image is read-only, code is
+    // copied out of it by UnmapCode() before it's written to.
+    bool code_mapped;
+    bool lines_mapped;
+    
+    int cache_count;
+    int cache_capacity;
+    InlineCache *caches;
 } Chunk;
 
+// ConstantMap maps the constants of a chunk to their index in it while the
+// chunk is being compiled, so that each distinct constant is added once. It
+// holds indices, not values, so the GC can ignore it.
+typedef struct {
+    int count;
+    int capacity; // 0 or a power of 2
+    int *slots; // Index of a constant plus one, 0 for empty slots
+} ConstantMap;
+
+void InitConstantMap(ConstantMap *map);
+void FreeConstantMap(ConstantMap *map);
+
 void InitChunk(Chunk *chunk);
 void FreeChunk(Chunk *chunk);
+// UnmapCode gives chunk a copy of its code, which points into a bytecode
+// image, that it owns and can write to. It may trigger a GC cycle.
+void UnmapCode(Chunk *chunk);
 
 void MarkChunk(Chunk *chunk);
 
 void WriteChunk(Chunk *chunk, uint8_t byte, int line);
-void WriteConstant(Chunk *chunk, OpCode op_simple, OpCode op_long, Value value, int line);
+// TruncateChunk drops the code from offset count on, e.g. to replace it.
+void TruncateChunk(Chunk *chunk, int count);
+// WriteConstant writes an instruction loading value from the constants of the
+// chunk, reusing the constant's slot if map has one for it.
+void WriteConstant(Chunk *chunk, ConstantMap *map, OpCode op_simple, OpCode op_long, Value value, int line);
+
+// AddInlineCache adds an empty inline cache to the chunk and returns its index.
+int AddInlineCache(Chunk *chunk);
+
+// InstructionLength returns the length of the instruction at offset, operands
+// included.
+int InstructionLength(Chunk *chunk, int offset);
 
 int GetLine(Chunk *chunk, int offset);
 
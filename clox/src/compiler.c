@@ -1,3 +1,4 @@
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,7 +6,9 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "number.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
 #include "value.h"
 
@@ -15,6 +18,7 @@
 
 void Push(Value value);
 Value Pop();
+int GlobalSlot(ObjString *name);
 
 typedef struct {
   Token previous;
@@ -54,8 +58,15 @@ typedef enum {
 
 typedef struct {
   Obj *name;
+  int slot; // index of the variable in vm.globals
   bool is_const;
   
+  // Whether the global is const and its initialiser is a constant expression,
+  // whose value is then used instead of looking the global up.
+  bool has_constant;
+  Value constant;
+  
+  bool declared; // true iff the global was declared by this compilation
   bool reassigned; // true iff the global was reassigned
   Token reassign_token; // assignment operator (=) where the global was reassigned
 } Global;
@@ -65,6 +76,11 @@ typedef struct {
   bool is_const;
   bool is_captured;
   
+  // Same as for Global, but only reads from the function declaring the local
+  // use the value.
+  bool has_constant;
+  Value constant;
+  
   // depth of the scope in which the local variable was declared or -1.
   // depth is -1 iff the variable was added to the scope but is not yet ready for use.
   int depth;
@@ -109,6 +125,14 @@ typedef struct Compiler {
   int loop_count;
   int loop_capacity;
   
+  // Offset of the last OP_CALL or OP_INVOKE emitted, or -1. A return statement
+  // whose expression ends with it turns it into an OP_TAIL_CALL or an
+  // OP_TAIL_INVOKE.
+  int last_call;
+  
+  // Indices of the constants of function's chunk, to add each of them once.
+  ConstantMap constants;
+  
   // depth of the scope in which the function being declared is,
   // or -1 if no function is being declared
   int function_depth;
@@ -126,6 +150,10 @@ ClassCompiler *current_class = NULL;
 Global *Globals = NULL;
 int Global_count = 0;
 int Global_capacity = 0;
+
+// Offset in the current chunk of the code of the left operand of the infix
+// expression being compiled.
+static int operand_start = 0;
   
 
 static Chunk *currentChunk() {
@@ -147,6 +175,10 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
   compiler->loop_count = 0;
   compiler->loop_capacity = 0;
   
+  compiler->last_call = -1;
+  
+  InitConstantMap(&compiler->constants);
+  
   compiler->function_depth = -1;
   compiler->scope_depth = 0;
   compiler->function = NewFunction(); IncrementRefcountObject((Obj*) compiler->function);
@@ -185,8 +217,22 @@ static void emitReturn() {
   
 static ObjFunction *endCompiler() {
   emitReturn();
+  FreeConstantMap(&current->constants);
+  
+  #ifndef NO_PEEPHOLE
+  OptimizeChunk(currentChunk());
+  #endif
   
   ObjFunction *function = current->function;
+  int depth = MaxStackDepth(currentChunk());
+  if (depth < 0) {
+    // The code of a chunk with a parse error may have inconsistent stack
+    // depths. It's never run, but still needs a size: no instruction grows
+    // the stack by more than one value. Any other chunk would be a bug.
+    assert(parser.had_error);
+    depth = currentChunk()->count;
+  }
+  function->stack_size = 1 + function->arity + depth;
   
   #ifdef DEBUG_PRINT_CODE
   if (!parser.had_error) {
@@ -205,13 +251,14 @@ static bool sameVariable(Token a, Token b) {
 }
 
 static Local *newLocal(Compiler *compiler) {
-  if (compiler->local_count < compiler->local_capacity) {
-    return &compiler->locals[compiler->local_count++];
+  if (compiler->local_count == compiler->local_capacity) {
+    compiler->local_capacity = GROW_CAPACITY(compiler->local_capacity);
+    compiler->locals = GROW_ARRAY(Local, compiler->locals, compiler->local_count, compiler->local_capacity);
   }
   
-  compiler->local_capacity = GROW_CAPACITY(compiler->local_capacity);
-  compiler->locals = GROW_ARRAY(Local, compiler->locals, compiler->local_count, compiler->local_capacity);
-  return &compiler->locals[compiler->local_count++];
+  Local *local = &compiler->locals[compiler->local_count++];
+  local->has_constant = false;
+  return local;
 }
 
 // Returns true iff the local was successfully declared.
@@ -247,6 +294,8 @@ static void duplicateTopLocal() {
   Local *local = newLocal(current);
   local->name = top_local->name;
   local->is_const = top_local->is_const;
+  local->has_constant = top_local->has_constant;
+  local->constant = top_local->constant;
   local->is_captured = false;
   local->depth = current->scope_depth;
 }
@@ -275,6 +324,9 @@ static uint8_t numLocals(Compiler *compiler, int depth) {
   return n;
 }
 
+static void errorAt(Token *token, const char *message);
+static void error(const char *message);
+
 static void growGlobals() {
   Global_capacity = GROW_CAPACITY(Global_capacity);
   Globals = GROW_ARRAY(Global, Globals, Global_count, Global_capacity);
@@ -283,24 +335,58 @@ static void growGlobals() {
 // getGlobal returns the global with the given name (if it already exists) or
 // creates a new global with the given name (if it doesn't exist yet).
 static Global *getGlobal(Obj *name) {
-  for (uint8_t i = 0; i < Global_count; i++) {
+  for (int i = 0; i < Global_count; i++) {
     if (Globals[i].name == name) {
       return &Globals[i];
     }
   }
   
+  Push(FromObj(name)); // growGlobals() and GlobalSlot() might trigger a GC cycle
+  
   if (Global_count == Global_capacity) {
     growGlobals();
   }
   
+  int slot = GlobalSlot((ObjString*) name);
+  if (slot > UINT16_MAX) {
+    error("Too many global variables.");
+  }
+  
   Global *global = &Globals[Global_count++];
   global->name = name;
-  global->is_const = false;
+  global->slot = slot;
+  // Declared const by an earlier compilation, see Compile().
+  global->is_const = vm.globals[slot].is_const;
+  global->has_constant = false;
+  global->declared = false;
   global->reassigned = false;
   
+  Pop(); // name
+  
   return global;
 }
 
+// declareGlobal records that the declaration at name declares global. A const
+// global can't be redeclared, whether it was declared earlier in this
+// compilation or by an earlier one (REPL line) whose declaration already ran.
+static void declareGlobal(Global *global, Token *name, bool is_const) {
+  if (global->is_const && (global->declared || vm.globals[global->slot].defined)) {
+    errorAt(name, "Can't redeclare const global variable.");
+    return;
+  }
+  
+  global->declared = true;
+  global->is_const = is_const;
+  global->has_constant = false;
+}
+
+// emitGlobal emits op with the slot of global as operand.
+static void emitGlobal(OpCode op, Global *global) {
+  emitByte(op);
+  emitByte(global->slot & 0xFF);
+  emitByte((global->slot >> 8) & 0xFF);
+}
+
 static void growLoops(Compiler *compiler) {
   compiler->loop_capacity = GROW_CAPACITY(compiler->loop_capacity);
   compiler->loops = GROW_ARRAY(Loop, compiler->loops, compiler->loop_count, compiler->loop_capacity);
@@ -422,20 +508,20 @@ static void emitByte(uint8_t byte) {
   WriteChunk(currentChunk(), byte, parser.previous.line);
 }
 
-static void emitByteAt(uint8_t byte, uint8_t address) {
+static void emitByteAt(uint8_t byte, int address) {
   currentChunk()->code[address] = byte;
 }
 
 static void emitConstant(Value value) {
   Push(value);
-  WriteConstant(currentChunk(), OP_CONSTANT, OP_CONSTANT_LONG, value, parser.previous.line);
+  WriteConstant(currentChunk(), &current->constants, OP_CONSTANT, OP_CONSTANT_LONG, value, parser.previous.line);
   Pop();
 }
 
 static void emitClosure(ObjFunction *function, Upvalue *upvalues) {
   Value fun_val = FromObj((Obj*) function);
   Push(fun_val);
-  WriteConstant(currentChunk(), OP_CLOSURE, OP_CLOSURE_LONG, fun_val, parser.previous.line);
+  WriteConstant(currentChunk(), &current->constants, OP_CLOSURE, OP_CLOSURE_LONG, fun_val, parser.previous.line);
   Pop();
   
   for (int i = 0; i < function->upvalue_count; i++) {
@@ -444,11 +530,34 @@ static void emitClosure(ObjFunction *function, Upvalue *upvalues) {
   }
 }
 
+// emitInlineCache adds an inline cache to the current chunk and emits its index
+// as a 2B operand.
+static void emitInlineCache() {
+  int cache = AddInlineCache(currentChunk());
+  if (cache > UINT16_MAX) {
+    error("Too many property accesses in one function.");
+    return;
+  }
+  
+  emitByte(cache & 0xFF); // little endian
+  emitByte((cache >> 8) & 0xFF);
+}
+
 static void emitInvoke(Obj *attribute, uint8_t argc) {
   Value attr_val = FromObj(attribute);
   Push(attr_val);
-  WriteConstant(currentChunk(), OP_INVOKE, OP_INVOKE_LONG, attr_val, parser.previous.line);
+  current->last_call = currentChunk()->count;
+  WriteConstant(currentChunk(), &current->constants, OP_INVOKE, OP_INVOKE_LONG, attr_val, parser.previous.line);
   WriteChunk(currentChunk(), argc, parser.previous.line);
+  emitInlineCache();
+  Pop();
+}
+
+static void emitProperty(Obj *attribute) {
+  Value attr_val = FromObj(attribute);
+  Push(attr_val);
+  WriteConstant(currentChunk(), &current->constants, OP_IDENT_PROPERTY, OP_IDENT_PROPERTY_LONG, attr_val, parser.previous.line);
+  emitInlineCache();
   Pop();
 }
 
@@ -457,6 +566,119 @@ static void emitBoolean(bool boolean) {
   emitByte(byte);
 }
 
+// emitValue emits an instruction loading value.
+static void emitValue(Value value) {
+  if (IsBoolean(value)) {
+    emitBoolean(AsBoolean(value));
+  } else {
+    emitConstant(value);
+  }
+}
+
+// constantAt returns true iff the code from offset start to offset end is a
+// single instruction loading a constant, in which case it's stored in value.
+static bool constantAt(int start, int end, Value *value) {
+  Chunk *chunk = currentChunk();
+  if (start >= end) {
+    return false;
+  }
+  
+  uint8_t *code = &chunk->code[start];
+  switch (code[0]) {
+    case OP_CONSTANT:
+      if (end - start != 2) {
+        return false;
+      }
+      *value = chunk->constants.values[code[1]];
+      return true;
+    case OP_CONSTANT_LONG:
+      if (end - start != 4) {
+        return false;
+      }
+      *value = chunk->constants.values[code[1] | code[2] << 8 | code[3] << 16];
+      return true;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      if (end - start != 1) {
+        return false;
+      }
+      *value = code[0] == OP_NIL ? FromNil() : FromBoolean(code[0] == OP_TRUE);
+      return true;
+    default:
+      return false;
+  }
+}
+
+// concatenateConstants returns the interned concatenation of a and b.
+static Obj *concatenateConstants(ObjString *a, ObjString *b) {
+  size_t length = a->length + b->length;
+  char *chars = ALLOCATE(char, length + 1);
+  memcpy(chars, a->chars, a->length);
+  memcpy(chars + a->length, b->chars, b->length);
+  Obj *string = FromString(chars, length);
+  FREE_ARRAY(char, chars, length + 1);
+  
+  return string;
+}
+
+// The fold functions compute the result of an operator applied to constants
+// at compile time, as the VM would. They return false if the VM would raise
+// an error instead, which is then left for runtime.
+
+static bool foldUnary(TokenType op, Value operand, Value *result) {
+  switch (op) {
+    case TOKEN_MINUS:
+      if (!IsNumber(operand)) {
+        return false;
+      }
+      *result = FromDouble(-AsNumber(operand));
+      return true;
+    case TOKEN_BANG:
+      *result = FromBoolean(!IsTruthy(operand));
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool foldBinary(TokenType op, Value a, Value b, Value *result) {
+  switch (op) {
+    case TOKEN_EQUAL_EQUAL:
+      *result = FromBoolean(ValuesEqual(a, b));
+      return true;
+    case TOKEN_BANG_EQUAL:
+      *result = FromBoolean(!ValuesEqual(a, b));
+      return true;
+    case TOKEN_PLUS:
+      if (IsString(a) && IsString(b)) {
+        *result = FromObj(concatenateConstants((ObjString*) AsObj(a), (ObjString*) AsObj(b)));
+        return true;
+      }
+      break;
+    default:
+      break;
+  }
+  
+  if (!IsNumber(a) || !IsNumber(b)) {
+    return false;
+  }
+  
+  double x = AsNumber(a);
+  double y = AsNumber(b);
+  switch (op) {
+    case TOKEN_PLUS: *result = FromDouble(x + y); return true;
+    case TOKEN_MINUS: *result = FromDouble(x - y); return true;
+    case TOKEN_STAR: *result = FromDouble(x * y); return true;
+    case TOKEN_SLASH: *result = FromDouble(x / y); return true;
+    case TOKEN_GREATER: *result = FromBoolean(x > y); return true;
+    case TOKEN_GREATER_EQUAL: *result = FromBoolean(x >= y); return true;
+    case TOKEN_LESS: *result = FromBoolean(x < y); return true;
+    case TOKEN_LESS_EQUAL: *result = FromBoolean(x <= y); return true;
+    default: return false;
+  }
+}
+
 // emitJump emits the byte instructions for a jump with a dummy operand value, 
 // and returns the address of the opcode.
 static int emitJump(OpCode jump_type) {
@@ -506,11 +728,13 @@ static void parsePrecedence(Precedence precedence) {
   }
   
   bool can_assign = precedence <= PREC_ASSIGNMENT;
+  int start = ip();
   prefix_rule(can_assign);
   
   while (precedence <= getRule(parser.current.type)->precedence) {
     advance();
     ParseFn infix_rule = getRule(parser.previous.type)->infix;
+    operand_start = start;
     infix_rule(can_assign);
   }
   
@@ -524,7 +748,7 @@ static void expression() {
 }
 
 static void number(bool can_assign) {
-  double value = strtod(parser.previous.start, NULL);
+  double value = ParseNumber(parser.previous.start, parser.previous.length);
   emitConstant(FromDouble(value));
 }
 
@@ -604,6 +828,11 @@ static void identifierLocal(Compiler *compiler, bool can_assign, int local) {
     return;
   }
   
+  if (compiler->locals[local].has_constant) {
+    emitValue(compiler->locals[local].constant);
+    return;
+  }
+  
   emitByte(OP_IDENT_LOCAL);
   emitByte(local);
 }
@@ -641,23 +870,28 @@ static void identifierToken(bool can_assign, Token token) {
   }
   
   Obj *name = FromString(token.start, token.length);
-  emitConstant(FromObj(name)); 
+  Global *global = getGlobal(name);
   
   if (can_assign && match(TOKEN_EQUAL)) {
     Token op = parser.previous;
     
     parsePrecedence(PREC_ASSIGNMENT);
-    emitByte(OP_ASSIGN_GLOBAL);
     
-    Global *global = getGlobal(name);
+    // Compiling the right-hand side might have grown Globals.
+    global = getGlobal(name);
+    emitGlobal(OP_ASSIGN_GLOBAL, global);
     global->reassigned = true;
     global->reassign_token = op;
     
     return;
   }
   
-  emitByte(OP_IDENT_GLOBAL);
+  if (global->has_constant) {
+    emitValue(global->constant);
+    return;
+  }
   
+  emitGlobal(OP_IDENT_GLOBAL, global);
 }
 
 static void identifier(bool can_assign) {
@@ -672,8 +906,16 @@ static void grouping(bool can_assign) {
 static void unary(bool can_assign) {
   TokenType op = parser.previous.type;
   
+  int start = ip();
   parsePrecedence(PREC_UNARY);
   
+  Value operand, result;
+  if (constantAt(start, ip(), &operand) && foldUnary(op, operand, &result)) {
+    TruncateChunk(currentChunk(), start);
+    emitValue(result);
+    return;
+  }
+  
   switch (op) {
     case TOKEN_MINUS:
       emitByte(OP_NEGATE);
@@ -681,15 +923,27 @@ static void unary(bool can_assign) {
     case TOKEN_BANG:
       emitByte(OP_NOT);
       break;
+    default:
+      return; // Unreachable.
   }
 }
 
 static void binary(bool can_assign) {
   TokenType op_type = parser.previous.type;
+  int left_start = operand_start;
+  int right_start = ip();
   
   ParseRule *rule = getRule(op_type);
   parsePrecedence(nextPrecedence(rule->precedence));
   
+  Value left, right, result;
+  if (constantAt(left_start, right_start, &left) && constantAt(right_start, ip(), &right) &&
+      foldBinary(op_type, left, right, &result)) {
+    TruncateChunk(currentChunk(), left_start);
+    emitValue(result);
+    return;
+  }
+  
   switch (op_type) {
     case TOKEN_PLUS:
       emitByte(OP_ADD);
@@ -721,6 +975,8 @@ static void binary(bool can_assign) {
     case TOKEN_LESS_EQUAL:
       emitByte(OP_LESS_EQ);
       break;
+    default:
+      return; // Unreachable.
   }
 }
 
@@ -734,7 +990,7 @@ static void and(bool can_assign) {
   //     that block, the value of b will be at the top of the stack, which is the
   //     result of a && b.
   
-  uint8_t false_jump = emitJump(OP_JUMP_IF_FALSE);
+  int false_jump = emitJump(OP_JUMP_IF_FALSE);
   emitByte(OP_POP);
   parsePrecedence(nextPrecedence(PREC_AND));
   patchJump(false_jump, ip());
@@ -778,6 +1034,7 @@ static uint8_t args() {
 
 static void call(bool can_assign) {
   uint8_t argc = args(); 
+  current->last_call = currentChunk()->count;
   emitByte(OP_CALL); 
   emitByte(argc);
 }
@@ -799,8 +1056,7 @@ static void property(bool can_assign) {
   
     Pop(); // name
   } else {
-    emitConstant(FromObj(name)); 
-    emitByte(OP_IDENT_PROPERTY);
+    emitProperty(name);
   }
 }
 
@@ -905,6 +1161,8 @@ static void synchronise() {
       case TOKEN_FOR:
       case TOKEN_VAR:
         return;
+      default:
+        break;
     }
     
     advance();
@@ -919,13 +1177,16 @@ static void variableDeclarationLocal(bool is_const) {
       error("Already a variable with this name in this scope."); 
   }
   
+  int start = ip();
   if (match(TOKEN_EQUAL)) {
     expression();
   } else {
     emitByte(OP_NIL);
   }
   
-  current->locals[current->local_count - 1].depth = current->scope_depth;
+  Local *local = &current->locals[current->local_count - 1];
+  local->depth = current->scope_depth;
+  local->has_constant = is_const && constantAt(start, ip(), &local->constant);
   
   consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 }
@@ -939,11 +1200,13 @@ static void variableDeclaration(bool is_const) {
   // Variable declaration at the global scope.
   
   consume(TOKEN_IDENTIFIER, "Expect variable name.");
+  Token name_token = parser.previous;
   size_t length = parser.previous.length;
   const char *chars = parser.previous.start;
   Obj *name = FromString(chars, length);
-  emitConstant(FromObj(name)); 
+  Push(FromObj(name)); // Compiling the initialiser might trigger a GC cycle
   
+  int start = ip();
   if (match(TOKEN_EQUAL)) {
     expression();
   } else {
@@ -952,10 +1215,12 @@ static void variableDeclaration(bool is_const) {
   
   consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
   
-  emitByte(OP_VAR_DECL);
-  
   Global *global = getGlobal(name);
-  global->is_const = is_const;
+  declareGlobal(global, &name_token, is_const);
+  global->has_constant = global->is_const && constantAt(start, ip(), &global->constant);
+  emitGlobal(OP_VAR_DECL, global);
+  
+  Pop(); // name
 }
 
 static void expressionStatement() {
@@ -1166,8 +1431,6 @@ static void switchStatement() {
   }
   
   FREE_ARRAY(int, jmps, jmps_cap);
-  
-  endScope();
 }
 
 static void continueStatement() {
@@ -1279,15 +1542,13 @@ static void functionDeclaration() {
   } else {
     // Function declared in the global scope
     is_global = true;
-    Global *global = getGlobal(name_obj);
-    global->is_const = false;
-    emitConstant(FromObj(name_obj)); 
+    declareGlobal(getGlobal(name_obj), &name_token, /*is_const=*/ false);
   }
   
   compileFunction((ObjString*) name_obj, TYPE_FUNCTION);
   
   if (is_global) {
-    emitByte(OP_VAR_DECL); 
+    emitGlobal(OP_VAR_DECL, getGlobal(name_obj));
   }
   
   Pop(); // name_obj
@@ -1324,15 +1585,13 @@ static void classDeclaration() {
   } else {
     // Class declared in the global scope
     is_global = true;
-    Global *global = getGlobal(name_obj);
-    global->is_const = false;
-    emitConstant(FromObj(name_obj)); 
+    declareGlobal(getGlobal(name_obj), &name_token, /*is_const=*/ false);
   }
   
   ObjClass *class = NewClass((ObjString*) name_obj);
   emitConstant(FromObj((Obj*) class));
   if (is_global) {
-    emitByte(OP_VAR_DECL);
+    emitGlobal(OP_VAR_DECL, getGlobal(name_obj));
   }
   
   Pop(); // name_obj
@@ -1358,8 +1617,7 @@ static void classDeclaration() {
     current_class->hasSuperclass = true;
     
     if (is_global) {
-      emitConstant(FromObj(name_obj));
-      emitByte(OP_IDENT_GLOBAL);
+      emitGlobal(OP_IDENT_GLOBAL, getGlobal(name_obj));
     } else {
       identifierLocal(current, /*can_assign=*/false, findLocal(current, name_token));
     }
@@ -1369,8 +1627,7 @@ static void classDeclaration() {
   
   // Put the class name back at the stack to attach methods to the class.
   if (is_global) {
-    emitConstant(FromObj(name_obj));
-    emitByte(OP_IDENT_GLOBAL);
+    emitGlobal(OP_IDENT_GLOBAL, getGlobal(name_obj));
   } else {
     identifierLocal(current, /*can_assign=*/false, findLocal(current, name_token));
   }
@@ -1406,6 +1663,18 @@ static void returnStatement() {
     
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return expression.");
+    
+    // Jumps over the call, as in "return a and f(a);", land on the OP_RETURN.
+    Chunk *chunk = currentChunk();
+    int call = current->last_call;
+    if (call >= 0 && call + InstructionLength(chunk, call) == chunk->count) {
+      switch (chunk->code[call]) {
+        case OP_CALL: chunk->code[call] = OP_TAIL_CALL; break;
+        case OP_INVOKE: chunk->code[call] = OP_TAIL_INVOKE; break;
+        case OP_INVOKE_LONG: chunk->code[call] = OP_TAIL_INVOKE_LONG; break;
+        default: break;
+      }
+    }
     emitByte(OP_RETURN);
   }
 }
@@ -1466,12 +1735,22 @@ ObjFunction *Compile(const char *source) {
     declaration();
   }
   
-  for (uint8_t i = 0; i < Global_count; i++) {
+  for (int i = 0; i < Global_count; i++) {
     if (Globals[i].is_const && Globals[i].reassigned) {
       errorAt(&Globals[i].reassign_token, "Can't reassign to const global variable.");
     }
   }
+  // The compiled declarations only take effect when the script runs, so those
+  // of a script that failed to compile are forgotten.
+  if (!parser.had_error) {
+    for (int i = 0; i < Global_count; i++) {
+      vm.globals[Globals[i].slot].is_const = Globals[i].is_const;
+    }
+  }
   FREE_ARRAY(Global, Globals, Global_capacity);
+  Globals = NULL;
+  Global_count = 0;
+  Global_capacity = 0;
   
   ObjFunction *function = endCompiler();
   Push(FromObj((Obj*) function)); // freeCompiler() may trigger a GC cycle
@@ -1481,11 +1760,17 @@ ObjFunction *Compile(const char *source) {
   
   Pop(); // function
   
-  return parser.had_error ? NULL : function;
+  if (parser.had_error) {
+    DecrementRefcountObject((Obj*) function);
+    return NULL;
+  }
+  return function;
 }
 
 void MarkCompilerRoots() {
   for (Compiler *compiler = current; compiler != NULL; compiler = compiler->enclosing) {
     MarkObj((Obj*) compiler->function);
+    // The chunk of a function grows without write barriers while it's compiled.
+    Remember((Obj*) compiler->function);
   }
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 static int readNBytes(Chunk *chunk, int offset, int nbytes) {
     int constant = 0;
@@ -37,7 +38,7 @@ static int closureInstruction(const char *name, Chunk *chunk, int offset, int si
     
     offset += size_operand + 1;
     
-    ObjFunction *function = (ObjFunction*) value.as.obj;
+    ObjFunction *function = (ObjFunction*) AsObj(value);
     for (int i = 0; i < function->upvalue_count; i++) {
         bool local = chunk->code[offset] == 1;
         uint8_t index = chunk->code[offset + 1];
@@ -54,28 +55,35 @@ static int byteInstruction(const char *name, Chunk *chunk, int offset) {
     return offset + 2;
 }
 
+static int globalInstruction(const char *name, Chunk *chunk, int offset) {
+    int slot = readNBytes(chunk, offset, 2);
+    printf("%-16s %8d '%s'\n", name, slot, vm.globals[slot].name->chars);
+    return offset + 3;
+}
+
 static int shortInstructions(const char *name, Chunk *chunk, int offset) {
     int operand = readNBytes(chunk, offset, 2);
     printf("%-16s %8d\n", name, operand);
     return offset + 3;
 }
 
-static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
-    uint8_t first = readNBytes(chunk, offset, 1);
-    uint8_t second = chunk->code[offset + 2];
-    printf("%-16s ", name);
-    PrintValue(chunk->constants.values[first]);
-    printf(" %8d\n", second);
-    return offset + 3;
+static int propertyInstruction(const char *name, Chunk *chunk, int offset, int size_operand) {
+    int constant = readNBytes(chunk, offset, size_operand);
+    int cache = readNBytes(chunk, offset + size_operand, 2);
+    printf("%-16s %8d '", name, constant);
+    PrintValue(chunk->constants.values[constant]);
+    printf("' (cache %d)\n", cache);
+    return offset + size_operand + 3;
 }
 
-static int invokeLongInstruction(const char *name, Chunk *chunk, int offset) {
-    uint8_t first = readNBytes(chunk, offset, 2);
-    uint8_t second = chunk->code[offset + 3];
+static int invokeInstruction(const char *name, Chunk *chunk, int offset, int size_operand) {
+    int constant = readNBytes(chunk, offset, size_operand);
+    uint8_t argc = chunk->code[offset + size_operand + 1];
+    int cache = readNBytes(chunk, offset + size_operand + 1, 2);
     printf("%-16s ", name);
-    PrintValue(chunk->constants.values[first]);
-    printf(" %8d\n", second);
-    return offset + 4;
+    PrintValue(chunk->constants.values[constant]);
+    printf(" %8d (cache %d)\n", argc, cache);
+    return offset + size_operand + 4;
 }
 
 int DisassembleInstruction(Chunk *chunk, int offset) {
@@ -128,17 +136,19 @@ int DisassembleInstruction(Chunk *chunk, int offset) {
         case OP_POPN:
             return byteInstruction("OP_POPN", chunk, offset);
         case OP_VAR_DECL:
-            return simpleInstruction("OP_VAR_DECL", offset);
+            return globalInstruction("OP_VAR_DECL", chunk, offset);
         case OP_IDENT_GLOBAL:
-            return simpleInstruction("OP_IDENT_GLOBAL", offset);
+            return globalInstruction("OP_IDENT_GLOBAL", chunk, offset);
         case OP_ASSIGN_GLOBAL:
-            return simpleInstruction("OP_ASSIGN_GLOBAL", offset);
+            return globalInstruction("OP_ASSIGN_GLOBAL", chunk, offset);
         case OP_IDENT_LOCAL:
             return byteInstruction("OP_IDENT_LOCAL", chunk, offset);
         case OP_ASSIGN_LOCAL:
             return byteInstruction("OP_ASSIGN_LOCAL", chunk, offset);
         case OP_IDENT_PROPERTY:
-            return simpleInstruction("OP_IDENT_PROPERTY", offset);
+            return propertyInstruction("OP_IDENT_PROPERTY", chunk, offset, 1);
+        case OP_IDENT_PROPERTY_LONG:
+            return propertyInstruction("OP_IDENT_PROPERTY_LONG", chunk, offset, 3);
         case OP_ASSIGN_PROPERTY:
             return simpleInstruction("OP_ASSIGN_PROPERTY", offset);
         case OP_IDENT_UPVALUE:
@@ -151,14 +161,22 @@ int DisassembleInstruction(Chunk *chunk, int offset) {
             return shortInstructions("OP_JUMP_IF_FALSE", chunk, offset);
         case OP_JUMP:
             return shortInstructions("OP_JUMP", chunk, offset);
+        case OP_JUMP_IF_TRUE:
+            return shortInstructions("OP_JUMP_IF_TRUE", chunk, offset);
         case OP_DUPLICATE:
             return simpleInstruction("OP_DUPLICATE", offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_INVOKE:
-            return invokeInstruction("OP_INVOKE", chunk, offset);
+            return invokeInstruction("OP_INVOKE", chunk, offset, 1);
         case OP_INVOKE_LONG:
-            return invokeLongInstruction("OP_INVOKE_LONG", chunk, offset);
+            return invokeInstruction("OP_INVOKE_LONG", chunk, offset, 3);
+        case OP_TAIL_INVOKE:
+            return invokeInstruction("OP_TAIL_INVOKE", chunk, offset, 1);
+        case OP_TAIL_INVOKE_LONG:
+            return invokeInstruction("OP_TAIL_INVOKE_LONG", chunk, offset, 3);
         case OP_CLOSURE:
             return closureInstruction("OP_CLOSURE", chunk, offset, 1);
         case OP_CLOSURE_LONG:
@@ -171,6 +189,22 @@ int DisassembleInstruction(Chunk *chunk, int offset) {
             return simpleInstruction("OP_INHERIT", offset);
         case OP_GET_SUPER:
             return simpleInstruction("OP_GET_SUPER", offset);
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_SUBTRACT_NUM:
+            return simpleInstruction("OP_SUBTRACT_NUM", offset);
+        case OP_MULTIPLY_NUM:
+            return simpleInstruction("OP_MULTIPLY_NUM", offset);
+        case OP_DIVIDE_NUM:
+            return simpleInstruction("OP_DIVIDE_NUM", offset);
+        case OP_LESS_NUM:
+            return simpleInstruction("OP_LESS_NUM", offset);
+        case OP_LESS_EQ_NUM:
+            return simpleInstruction("OP_LESS_EQ_NUM", offset);
+        case OP_GREATER_NUM:
+            return simpleInstruction("OP_GREATER_NUM", offset);
+        case OP_GREATER_EQ_NUM:
+            return simpleInstruction("OP_GREATER_EQ_NUM", offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -31,6 +31,18 @@ void FreeLines(Lines* lines) {
     InitLines(lines);
 }
 
+void PopLines(Lines* lines, int n) {
+    while (n > 0 && lines->count > 0) {
+        int *length = &lines->lengths[lines->count - 1];
+        if (*length > n) {
+            *length -= n;
+            return;
+        }
+        n -= *length;
+        lines->count--;
+    }
+}
+
 int GetLineAtOffset(Lines* lines, int offset) {
     if (offset < 0) {
         return -1;
@@ -11,6 +11,8 @@ typedef struct {
 void InitLines(Lines* lines);
 void WriteLines(Lines* lines, int line);
 void FreeLines(Lines* lines);
+// PopLines forgets the lines of the last n bytes.
+void PopLines(Lines* lines, int n);
 int GetLineAtOffset(Lines* lines, int offset);
 
 #endif
\ No newline at end of file
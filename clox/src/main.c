@@ -53,9 +53,28 @@ static char *readFile(const char *path) {
     return buffer;
 }
 
+// cachePath returns the path of the bytecode cache of the script at path:
+// foo.lox is cached in foo.loxc, other files get .loxc appended.
+static char *cachePath(const char *path) {
+    size_t length = strlen(path);
+    char *cache_path = malloc(length + 6);
+    if (cache_path == NULL) {
+        return NULL;
+    }
+    
+    if (length >= 4 && strcmp(path + length - 4, ".lox") == 0) {
+        sprintf(cache_path, "%sc", path);
+    } else {
+        sprintf(cache_path, "%s.loxc", path);
+    }
+    return cache_path;
+}
+
 static void runFile(const char *path) {
     char *source = readFile(path);
-    InterpretResult result = Interpret(source);
+    char *cache_path = cachePath(path);
+    InterpretResult result = InterpretCached(source, cache_path);
+    free(cache_path);
     free(source);
     
     if (result == INTERPRET_COMPILE_ERROR) {
@@ -1,7 +1,9 @@
 #include <stdlib.h>
+#include <time.h>
 
 #include "compiler.h"
 #include "memory.h"
+#include "slab.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
@@ -12,23 +14,85 @@
 #endif
 
 #define GC_HEAP_GROWTH_FACTOR 2
+#define ZCT_MIN_RECONCILE 1024
+#define NURSERY_SIZE (256 * 1024)
+#define PROMOTION_AGE 2
+
+#ifdef DEBUG_STRESS_GC
+// Tiny slices interleave marking with the mutator as much as possible.
+#define GC_SLICE_WORK 1
+#define GC_SLICE_BYTES 0
+#else
+#define GC_SLICE_WORK 64 // Objects traced between two checks of the clock
+#define GC_SLICE_BYTES (64 * 1024) // Allocation between two slices
+#endif
+
+// Number of references to young objects seen by MarkObj() during a minor
+// collection, used to find out which remembered objects still need to be.
+static int young_references = 0;
+
+static void markSlice();
+static void collectOld();
+
+static double microsSince(clock_t start) {
+    return (double) (clock() - start) * 1000000 / CLOCKS_PER_SEC;
+}
+
+static void recordPause(clock_t start) {
+    double pause = microsSince(start);
+    vm.gc_pause_count++;
+    vm.gc_pause_total += pause;
+    if (pause > vm.gc_pause_max) {
+        vm.gc_pause_max = pause;
+    }
+}
+
+// safepoint runs the collector if it's due. It's called before memory is
+// allocated, never during a GC cycle.
+static void safepoint() {
+    #ifdef DEBUG_STRESS_GC
+        // Major collections promote every survivor, so most cycles are
+        // minor to let objects age.
+        static int stress_cycles = 0;
+        if (vm.gc_phase == GC_MARKING) {
+            markSlice();
+        } else {
+            ReconcileRefcounts();
+            if (++stress_cycles % 4 == 0) {
+                collectOld();
+            } else {
+                CollectYoungGarbage();
+            }
+        }
+    #else
+        if (vm.gc_phase == GC_MARKING) {
+            // Reconciling and minor collections use the mark bits too,
+            // they wait for the end of the cycle.
+            if (vm.bytes_allocated > vm.next_gc_slice) {
+                markSlice();
+            }
+        } else {
+            if (vm.zct_count > vm.next_reconcile) {
+                ReconcileRefcounts();
+            }
+            if (vm.bytes_allocated > vm.next_gc) {
+                collectOld();
+            } else if (vm.young_bytes > NURSERY_SIZE) {
+                CollectYoungGarbage();
+            }
+        }
+    #endif
+}
 
 void *Reallocate(void *pointer, size_t old_size, size_t new_size) {
     #ifdef DEBUG_LOG_GC
-        printf("Reallocate(%p, %d, %d)\n", pointer, old_size, new_size);
+        printf("Reallocate(%p, %zu, %zu)\n", pointer, old_size, new_size);
     #endif
     
     if (new_size > old_size) {
         // Because we check if new_size > old_size, we will never enter here
         // during a GC cycle.
-        
-        #ifdef DEBUG_STRESS_GC
-            CollectGarbage();
-        #else
-            if (vm.bytes_allocated > vm.next_gc) {
-                CollectGarbage();
-            }
-        #endif
+        safepoint();
     }
     
     // We can't simply vm.bytes_allocated += new_size - old_size because
@@ -49,16 +113,30 @@ void *Reallocate(void *pointer, size_t old_size, size_t new_size) {
     return pointer;
 }
 
+void *AllocateObjMemory(size_t size) {
+    safepoint();
+    vm.bytes_allocated += size;
+    return SlabAlloc(size);
+}
+
+void FreeObjMemory(void *pointer, size_t size) {
+    vm.bytes_allocated -= size;
+    SlabFree(pointer, size);
+}
+
 void IncrementRefcountValue(Value value) {
     if (!IsObj(value)) {
         return;
     }
     
-    IncrementRefcountObject(value.as.obj);
+    IncrementRefcountObject(AsObj(value));
 }
 
 void IncrementRefcountObject(Obj *obj) {
-    obj->refcount++;    
+    if (obj->immortal) {
+        return;
+    }
+    obj->refcount++;
     
     #ifdef DEBUG_LOG_GC
         printf("Increment refcount of ");
@@ -72,12 +150,12 @@ void DecrementRefcountValue(Value value) {
         return;
     }
     
-    DecrementRefcountObject(value.as.obj);
+    DecrementRefcountObject(AsObj(value));
 }
 
 void DecrementRefcountObject(Obj *obj) {
     // During GC cycles, DecrementRefcountObject() may be called on objects with refcount == 0.
-    if (obj->refcount == 0) {
+    if (obj->refcount == 0 || obj->immortal) {
         return;
     }
     
@@ -90,11 +168,72 @@ void DecrementRefcountObject(Obj *obj) {
     #endif
     
     if (obj->refcount == 0) {
-        FreeObj(obj);
+        // The object might still be on the stack, ReconcileRefcounts() decides.
+        AddToZct(obj);
+    }
+}
+
+void AddToZct(Obj *obj) {
+    if (obj->zct_index >= 0) {
+        return;
     }
+    
+    // Like the grey stack, the table doesn't go through Reallocate() so that
+    // growing it never triggers a GC cycle.
+    if (vm.zct_count == vm.zct_capacity) {
+        vm.zct_capacity = GROW_CAPACITY(vm.zct_capacity);
+        vm.zct = (Obj**) realloc(vm.zct, vm.zct_capacity * sizeof(Obj*));
+        if (vm.zct == NULL) {
+            exit(1);
+        }
+    }
+    
+    obj->zct_index = vm.zct_count;
+    vm.zct[vm.zct_count++] = obj;
+}
+
+void RemoveFromZct(Obj *obj) {
+    // Move the last entry to the removed object's index.
+    Obj *last = vm.zct[--vm.zct_count];
+    last->zct_index = obj->zct_index;
+    vm.zct[obj->zct_index] = last;
+    obj->zct_index = -1;
+}
+
+void Remember(Obj *obj) {
+    if (!obj->old || obj->remembered_index >= 0) {
+        return;
+    }
+    
+    if (vm.remembered_count == vm.remembered_capacity) {
+        vm.remembered_capacity = GROW_CAPACITY(vm.remembered_capacity);
+        vm.remembered = (Obj**) realloc(vm.remembered, vm.remembered_capacity * sizeof(Obj*));
+        if (vm.remembered == NULL) {
+            exit(1);
+        }
+    }
+    
+    obj->remembered_index = vm.remembered_count;
+    vm.remembered[vm.remembered_count++] = obj;
+}
+
+void Forget(Obj *obj) {
+    // Move the last entry to the forgotten object's index.
+    Obj *last = vm.remembered[--vm.remembered_count];
+    last->remembered_index = obj->remembered_index;
+    vm.remembered[obj->remembered_index] = last;
+    obj->remembered_index = -1;
 }
 
 void MarkObj(Obj *obj) {
+    if (vm.collecting_young) {
+        // Old objects are only traced by major collections.
+        if (obj->old) {
+            return;
+        }
+        young_references++;
+    }
+    
     if (obj->marked) {
         return;
     }
@@ -126,10 +265,12 @@ void MarkValue(Value value) {
     if (!IsObj(value)) {
         return;
     }
-    MarkObj(value.as.obj);
+    MarkObj(AsObj(value));
 }
 
-static void markRoots() {
+// markUncountedRoots marks the roots whose references to objects aren't
+// reflected in refcounts.
+static void markUncountedRoots() {
     for (int i = 0; i < vm.frame_count; i++) {
         MarkObj((Obj*) vm.frames[i].closure);
     }
@@ -138,8 +279,6 @@ static void markRoots() {
         MarkValue(*value);
     }
     
-    MarkTable(&vm.globals);
-    
     for (ObjUpvalue *upvalue = vm.open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
         MarkObj((Obj*) upvalue);
     }
@@ -152,6 +291,48 @@ static void markRoots() {
     MarkCompilerRoots();
 }
 
+static void markRoots() {
+    markUncountedRoots();
+    
+    MarkTable(&vm.global_slots);
+    for (int i = 0; i < vm.global_count; i++) {
+        MarkObj((Obj*) vm.globals[i].name);
+        MarkValue(vm.globals[i].value);
+    }
+}
+
+void ReconcileRefcounts() {
+    clock_t start = clock();
+    
+    // Only the objects referenced directly by the roots get marked. Anything
+    // they reference is counted, so it won't be in the table with refcount 0.
+    markUncountedRoots();
+    
+    // Freeing an object decrements the refcounts of its children, which may
+    // append them to the table. RemoveFromZct() and FreeObj() move the last
+    // entry to index i, so i only advances past the entries that stay.
+    int i = 0;
+    while (i < vm.zct_count) {
+        Obj *obj = vm.zct[i];
+        if (obj->refcount > 0) {
+            RemoveFromZct(obj);
+        } else if (!obj->marked) {
+            FreeObj(obj);
+        } else {
+            i++;
+        }
+    }
+    
+    while (vm.grey_count > 0) {
+        vm.grey_objects[--vm.grey_count]->marked = false;
+    }
+    
+    // The objects left are referenced from the stack. If there are many,
+    // reconciling again soon would mostly find the same ones.
+    vm.next_reconcile = vm.zct_count * 2 > ZCT_MIN_RECONCILE ? vm.zct_count * 2 : ZCT_MIN_RECONCILE;
+    recordPause(start);
+}
+
 static void blackify(Obj *obj) {
     #ifdef DEBUG_LOG_GC
         printf("blackify ");
@@ -162,6 +343,16 @@ static void blackify(Obj *obj) {
     switch (obj->type) {
         case OBJ_STRING:
             break;
+        case OBJ_ROPE: {
+            ObjRope *rope = (ObjRope*) obj;
+            if (rope->flat != NULL) {
+                MarkObj((Obj*) rope->flat);
+            } else {
+                MarkObj(rope->left);
+                MarkObj(rope->right);
+            }
+            break;
+        }
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction*) obj;
             if (function->name != NULL) {
@@ -198,6 +389,12 @@ static void blackify(Obj *obj) {
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance*) obj;
             MarkObj((Obj*) instance->class);
+            if (instance->shape != NULL) {
+                MarkShape(instance->shape);
+                for (int i = 0; i < instance->shape->count; i++) {
+                    MarkValue(instance->slots[i]);
+                }
+            }
             MarkTable(&instance->fields);
             break;
         }
@@ -219,40 +416,161 @@ static void trace() {
     }
 }
 
+static void releaseUnmarked(Obj *obj) {
+    if (!obj->marked) {
+        ReleaseObj(obj);
+    }
+}
+
+// sweepYoungObj frees an unmarked young object or ages it, promoting it to
+// the old generation when it's old enough.
+static void sweepYoungObj(Obj *obj) {
+    if (!obj->marked) {
+        FreeReleasedObj(obj);
+        return;
+    }
+    
+    obj->marked = false;
+    if (++obj->age >= PROMOTION_AGE) {
+        obj->old = true;
+        // It may reference the young objects that survived with it.
+        Remember(obj);
+    }
+}
+
+// sweepObj frees an unmarked object. Survivors of a major collection are
+// all promoted.
+static void sweepObj(Obj *obj) {
+    if (!obj->marked) {
+        FreeReleasedObj(obj);
+        return;
+    }
+    
+    obj->marked = false;
+    obj->old = true;
+}
+
 static void sweep() {
-    Obj *tail = NULL;
+    // Nothing is young after a major collection, so nothing needs to be
+    // remembered either. Clearing the set first spares Forget() calls.
+    while (vm.remembered_count > 0) {
+        vm.remembered[--vm.remembered_count]->remembered_index = -1;
+    }
     
-    Obj *obj = vm.objects;
-    while (obj != NULL) {
-        if (!obj->marked) {
-            // FreObj() fixes the list vm.objects
-            FreeObj(obj);
-            
-            if (tail == NULL) {
-                obj = vm.objects;
-            } else {
-                obj = tail->next;
-            }
-            continue;
-        }
-        
-        obj->marked = false;
-        obj->prev = tail;
-        
-        if (tail != NULL) {
-            tail->next = obj;
+    // Garbage may reference other garbage, so all of it is released before
+    // any of it is freed.
+    ForEachObj(false, releaseUnmarked);
+    ForEachObj(false, sweepObj);
+}
+
+void CollectYoungGarbage() {
+    clock_t start = clock();
+    vm.collecting_young = true;
+    markRoots();
+    
+    // The remembered objects stand in for the old generation. Those that no
+    // longer reference young objects are forgotten.
+    int i = 0;
+    while (i < vm.remembered_count) {
+        Obj *obj = vm.remembered[i];
+        young_references = 0;
+        blackify(obj);
+        if (young_references > 0) {
+            i++;
+        } else {
+            Forget(obj); // Moves the last entry to i
         }
-        tail = obj;
-        
-        obj = tail->next;
+    }
+    
+    trace();
+    SweepStringSet(&vm.strings, true);
+    ForEachObj(true, releaseUnmarked);
+    ForEachObj(true, sweepYoungObj);
+    
+    vm.collecting_young = false;
+    vm.young_bytes = 0;
+    recordPause(start);
+}
+
+// finishCollection frees what the marking left white and ends the cycle.
+// The sweep isn't sliced, its pause grows with the heap.
+static void finishCollection() {
+    clock_t start = clock();
+    SweepStringSet(&vm.strings, false);
+    sweep();
+    
+    vm.gc_phase = GC_IDLE;
+    vm.young_bytes = 0;
+    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROWTH_FACTOR;
+    
+    double pause = microsSince(start);
+    if (pause > vm.gc_sweep_max) {
+        vm.gc_sweep_max = pause;
     }
 }
 
 void CollectGarbage() {
+    clock_t start = clock();
     markRoots();
     trace();
-    RemoveUnmarkedKeys(&vm.strings);
-    sweep();
+    finishCollection();
+    recordPause(start);
+}
+
+void StartIncrementalGarbage() {
+    clock_t start = clock();
+    vm.gc_phase = GC_MARKING;
+    markRoots();
+    vm.next_gc_slice = vm.bytes_allocated + GC_SLICE_BYTES;
+    recordPause(start);
+}
+
+// markSlice traces grey objects until the pause budget runs out. Once there
+// are none left, the roots are marked again, since they change without write
+// barriers, and the cycle ends with a sweep in the same pause. Only the
+// marking counts against the budget.
+static void markSlice() {
+    clock_t start = clock();
+    bool marked = false;
+    for (;;) {
+        for (int i = 0; i < GC_SLICE_WORK && vm.grey_count > 0; i++) {
+            blackify(vm.grey_objects[--vm.grey_count]);
+        }
+        
+        if (vm.grey_count == 0) {
+            markRoots();
+            trace();
+            marked = true;
+            break;
+        }
+        
+        #ifdef DEBUG_STRESS_GC
+            break;
+        #endif
+        if (microsSince(start) >= GC_PAUSE_BUDGET_US) {
+            break;
+        }
+    }
     
-    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROWTH_FACTOR;
+    double slice = microsSince(start);
+    if (slice > vm.gc_slice_max) {
+        vm.gc_slice_max = slice;
+    }
+    if (slice > GC_PAUSE_BUDGET_US) {
+        vm.gc_slices_over_budget++;
+    }
+    if (marked) {
+        finishCollection();
+    }
+    
+    vm.next_gc_slice = vm.bytes_allocated + GC_SLICE_BYTES;
+    recordPause(start);
+}
+
+static void collectOld() {
+    #ifdef INCREMENTAL_GC
+        StartIncrementalGarbage();
+    #else
+        CollectGarbage();
+    #endif
 }
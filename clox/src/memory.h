@@ -4,6 +4,14 @@
 #include "common.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
+
+// Target for the pause times of incremental marking slices, in microseconds.
+// They stop once they reach it. The sweep that ends a major collection, and
+// minor collections, run in one pause whatever their length.
+#ifndef GC_PAUSE_BUDGET_US
+#define GC_PAUSE_BUDGET_US 1000
+#endif
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
@@ -21,11 +29,17 @@
 #define ALLOCATE(type, count) \
     (type*) Reallocate(NULL, 0, sizeof(type) * (count))
     
-// Same as ALLOCATE but for objects with flexible array members.
+// Objects come from the slab allocator (see slab.h) rather than from
+// Reallocate(). ALLOCATE_FAM is for objects with flexible array members.
 #define ALLOCATE_FAM(obj_type, ar_type, count) \
-    (obj_type*) Reallocate(NULL, 0, sizeof(obj_type) + (count) * sizeof(ar_type))
+    (obj_type*) AllocateObjMemory(sizeof(obj_type) + (count) * sizeof(ar_type))
+
+#define FREE_OBJ(type, pointer) \
+    FreeObjMemory(pointer, sizeof(type))
         
 void* Reallocate(void *pointer, size_t old_size, size_t new_size);
+void *AllocateObjMemory(size_t size);
+void FreeObjMemory(void *pointer, size_t size);
 
 // GC related functions
 void IncrementRefcountValue(Value value);
@@ -33,8 +47,48 @@ void IncrementRefcountObject(Obj *obj);
 void DecrementRefcountValue(Value value);
 void DecrementRefcountObject(Obj *obj);
 
+// Reference counting is deferred: stack slots don't count as references,
+// so an object whose refcount is 0 may still be on the stack. Such objects
+// are kept in the zero count table (vm.zct) until ReconcileRefcounts()
+// checks them against the stack, at the same safepoints as the GC.
+void AddToZct(Obj *obj);
+void RemoveFromZct(Obj *obj);
+void ReconcileRefcounts();
+
+// The heap has two generations. New objects are young; the ones that survive
+// PROMOTION_AGE minor collections are promoted to the old generation.
+// CollectYoungGarbage() only traces and sweeps young objects, using the old
+// objects in vm.remembered as extra roots. Stores of a reference into an
+// object must be followed by WriteBarrier() so that an old object pointing to
+// a young one is remembered.
+void CollectYoungGarbage();
 void CollectGarbage();
+void Remember(Obj *obj);
+void Forget(Obj *obj);
+
+// Incremental major collections mark the heap in slices. While the heap is
+// being marked, the mutator must not hide an unmarked object in an object
+// that was already traced: WriteBarrier() shades the stored value, and new
+// objects are allocated marked. The roots are marked again at the end.
+void StartIncrementalGarbage();
 void MarkObj(Obj *obj);
+
+static inline void ShadeObj(Obj *obj) {
+    if (vm.gc_phase == GC_MARKING) {
+        MarkObj(obj);
+    }
+}
+
+static inline void WriteBarrier(Obj *obj, Value value) {
+    if (!IsObj(value)) {
+        return;
+    }
+    if (obj->old && obj->remembered_index < 0 && !AsObj(value)->old) {
+        Remember(obj);
+    }
+    ShadeObj(AsObj(value));
+}
+
 void MarkValue(Value value);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,428 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "number.h"
+
+// Doubles represent the powers of 10 up to 1e22 exactly.
+static const double exact_powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+#define MAX_EXACT_POWER 22
+#define MAX_EXACT_INTEGER ((uint64_t) 1 << 53)
+// Decimal digits that always fit in a uint64_t.
+#define MAX_SIGNIFICAND_DIGITS 19
+
+// parseSlowly is strtod() on the token. Lox has no locale, so the decimal
+// point is always '.'.
+static double parseSlowly(const char *start, int length) {
+    char *chars = malloc(length + 1);
+    if (chars == NULL) {
+        exit(1);
+    }
+    memcpy(chars, start, length);
+    chars[length] = '\0';
+    
+    double number = strtod(chars, NULL);
+    free(chars);
+    return number;
+}
+
+double ParseNumber(const char *start, int length) {
+    // The token is significand * 10^exponent.
+    uint64_t significand = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool fraction = false;
+    for (int i = 0; i < length; i++) {
+        if (start[i] == '.') {
+            fraction = true;
+            continue;
+        }
+        if (digits == MAX_SIGNIFICAND_DIGITS) {
+            return parseSlowly(start, length);
+        }
+        
+        significand = significand * 10 + (start[i] - '0');
+        if (significand != 0) {
+            digits++;
+        }
+        if (fraction) {
+            exponent--;
+        }
+    }
+    
+    // Clinger's fast path: when both the significand and the power of 10
+    // are exact doubles, a single multiplication or division rounds
+    // correctly.
+    if (significand <= MAX_EXACT_INTEGER && exponent >= -MAX_EXACT_POWER) {
+        return exponent < 0 ? (double) significand / exact_powers[-exponent] : (double) significand;
+    }
+    return parseSlowly(start, length);
+}
+
+// Shortest round-trip formatting uses Grisu3 (Florian Loitsch, "Printing
+// Floating-Point Numbers Quickly and Accurately with Integers", 2010). It
+// works on DiyFps, floating-point numbers with a 64-bit significand, and
+// finds the shortest digits for about 99.5% of doubles. It tells when it
+// can't, and the number is then formatted by formatSlowly().
+
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+#define DOUBLE_SIGNIFICAND_BITS 52
+#define DOUBLE_EXPONENT_BIAS (1023 + DOUBLE_SIGNIFICAND_BITS)
+#define DOUBLE_DENORMAL_EXPONENT (1 - DOUBLE_EXPONENT_BIAS)
+#define DOUBLE_HIDDEN_BIT ((uint64_t) 1 << DOUBLE_SIGNIFICAND_BITS)
+
+// The digits are generated from a DiyFp scaled by a power of 10 so that its
+// exponent is in this range.
+#define MIN_TARGET_EXPONENT (-60)
+#define MAX_TARGET_EXPONENT (-32)
+
+typedef struct {
+    uint64_t significand;
+    int16_t binary_exponent;
+    int16_t decimal_exponent;
+} CachedPower;
+
+// The powers of 10 from 1e-348 to 1e340, every 8, as normalised DiyFps with
+// their significand rounded to nearest.
+static const CachedPower cached_powers[] = {
+    {0xfa8fd5a0081c0288ULL, -1220, -348},
+    {0xbaaee17fa23ebf76ULL, -1193, -340},
+    {0x8b16fb203055ac76ULL, -1166, -332},
+    {0xcf42894a5dce35eaULL, -1140, -324},
+    {0x9a6bb0aa55653b2dULL, -1113, -316},
+    {0xe61acf033d1a45dfULL, -1087, -308},
+    {0xab70fe17c79ac6caULL, -1060, -300},
+    {0xff77b1fcbebcdc4fULL, -1034, -292},
+    {0xbe5691ef416bd60cULL, -1007, -284},
+    {0x8dd01fad907ffc3cULL, -980, -276},
+    {0xd3515c2831559a83ULL, -954, -268},
+    {0x9d71ac8fada6c9b5ULL, -927, -260},
+    {0xea9c227723ee8bcbULL, -901, -252},
+    {0xaecc49914078536dULL, -874, -244},
+    {0x823c12795db6ce57ULL, -847, -236},
+    {0xc21094364dfb5637ULL, -821, -228},
+    {0x9096ea6f3848984fULL, -794, -220},
+    {0xd77485cb25823ac7ULL, -768, -212},
+    {0xa086cfcd97bf97f4ULL, -741, -204},
+    {0xef340a98172aace5ULL, -715, -196},
+    {0xb23867fb2a35b28eULL, -688, -188},
+    {0x84c8d4dfd2c63f3bULL, -661, -180},
+    {0xc5dd44271ad3cdbaULL, -635, -172},
+    {0x936b9fcebb25c996ULL, -608, -164},
+    {0xdbac6c247d62a584ULL, -582, -156},
+    {0xa3ab66580d5fdaf6ULL, -555, -148},
+    {0xf3e2f893dec3f126ULL, -529, -140},
+    {0xb5b5ada8aaff80b8ULL, -502, -132},
+    {0x87625f056c7c4a8bULL, -475, -124},
+    {0xc9bcff6034c13053ULL, -449, -116},
+    {0x964e858c91ba2655ULL, -422, -108},
+    {0xdff9772470297ebdULL, -396, -100},
+    {0xa6dfbd9fb8e5b88fULL, -369, -92},
+    {0xf8a95fcf88747d94ULL, -343, -84},
+    {0xb94470938fa89bcfULL, -316, -76},
+    {0x8a08f0f8bf0f156bULL, -289, -68},
+    {0xcdb02555653131b6ULL, -263, -60},
+    {0x993fe2c6d07b7facULL, -236, -52},
+    {0xe45c10c42a2b3b06ULL, -210, -44},
+    {0xaa242499697392d3ULL, -183, -36},
+    {0xfd87b5f28300ca0eULL, -157, -28},
+    {0xbce5086492111aebULL, -130, -20},
+    {0x8cbccc096f5088ccULL, -103, -12},
+    {0xd1b71758e219652cULL, -77, -4},
+    {0x9c40000000000000ULL, -50, 4},
+    {0xe8d4a51000000000ULL, -24, 12},
+    {0xad78ebc5ac620000ULL, 3, 20},
+    {0x813f3978f8940984ULL, 30, 28},
+    {0xc097ce7bc90715b3ULL, 56, 36},
+    {0x8f7e32ce7bea5c70ULL, 83, 44},
+    {0xd5d238a4abe98068ULL, 109, 52},
+    {0x9f4f2726179a2245ULL, 136, 60},
+    {0xed63a231d4c4fb27ULL, 162, 68},
+    {0xb0de65388cc8ada8ULL, 189, 76},
+    {0x83c7088e1aab65dbULL, 216, 84},
+    {0xc45d1df942711d9aULL, 242, 92},
+    {0x924d692ca61be758ULL, 269, 100},
+    {0xda01ee641a708deaULL, 295, 108},
+    {0xa26da3999aef774aULL, 322, 116},
+    {0xf209787bb47d6b85ULL, 348, 124},
+    {0xb454e4a179dd1877ULL, 375, 132},
+    {0x865b86925b9bc5c2ULL, 402, 140},
+    {0xc83553c5c8965d3dULL, 428, 148},
+    {0x952ab45cfa97a0b3ULL, 455, 156},
+    {0xde469fbd99a05fe3ULL, 481, 164},
+    {0xa59bc234db398c25ULL, 508, 172},
+    {0xf6c69a72a3989f5cULL, 534, 180},
+    {0xb7dcbf5354e9beceULL, 561, 188},
+    {0x88fcf317f22241e2ULL, 588, 196},
+    {0xcc20ce9bd35c78a5ULL, 614, 204},
+    {0x98165af37b2153dfULL, 641, 212},
+    {0xe2a0b5dc971f303aULL, 667, 220},
+    {0xa8d9d1535ce3b396ULL, 694, 228},
+    {0xfb9b7cd9a4a7443cULL, 720, 236},
+    {0xbb764c4ca7a44410ULL, 747, 244},
+    {0x8bab8eefb6409c1aULL, 774, 252},
+    {0xd01fef10a657842cULL, 800, 260},
+    {0x9b10a4e5e9913129ULL, 827, 268},
+    {0xe7109bfba19c0c9dULL, 853, 276},
+    {0xac2820d9623bf429ULL, 880, 284},
+    {0x80444b5e7aa7cf85ULL, 907, 292},
+    {0xbf21e44003acdd2dULL, 933, 300},
+    {0x8e679c2f5e44ff8fULL, 960, 308},
+    {0xd433179d9c8cb841ULL, 986, 316},
+    {0x9e19db92b4e31ba9ULL, 1013, 324},
+    {0xeb96bf6ebadf77d9ULL, 1039, 332},
+    {0xaf87023b9bf0ee6bULL, 1066, 340}
+};
+
+#define CACHED_POWERS_OFFSET 348 // -decimal_exponent of the first power
+#define CACHED_POWERS_STEP 8
+#define LOG10_2 0.30102999566398114
+
+static DiyFp diyFpOf(double number) {
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    uint64_t fraction = bits & (DOUBLE_HIDDEN_BIT - 1);
+    int biased_exponent = (int) (bits >> DOUBLE_SIGNIFICAND_BITS) & 0x7FF;
+    
+    if (biased_exponent == 0) {
+        return (DiyFp) {.f = fraction, .e = DOUBLE_DENORMAL_EXPONENT};
+    }
+    return (DiyFp) {.f = fraction + DOUBLE_HIDDEN_BIT, .e = biased_exponent - DOUBLE_EXPONENT_BIAS};
+}
+
+static DiyFp normalize(DiyFp x) {
+    int shift = __builtin_clzll(x.f);
+    return (DiyFp) {.f = x.f << shift, .e = x.e - shift};
+}
+
+// multiply returns the product of a and b, with its 64-bit significand
+// rounded.
+static DiyFp multiply(DiyFp a, DiyFp b) {
+    unsigned __int128 product = (unsigned __int128) a.f * b.f + ((uint64_t) 1 << 63);
+    return (DiyFp) {.f = (uint64_t) (product >> 64), .e = a.e + b.e + 64};
+}
+
+// boundaries computes the midpoints between number and its neighbouring
+// doubles, normalised and with the same exponent. Any decimal between them
+// reads back as number.
+static void boundaries(double number, DiyFp *minus, DiyFp *plus) {
+    DiyFp v = diyFpOf(number);
+    *plus = normalize((DiyFp) {.f = (v.f << 1) + 1, .e = v.e - 1});
+    
+    // The next double below a power of 2 is closer than the one above it.
+    bool lower_is_closer = v.f == DOUBLE_HIDDEN_BIT && v.e != DOUBLE_DENORMAL_EXPONENT;
+    if (lower_is_closer) {
+        *minus = (DiyFp) {.f = (v.f << 2) - 1, .e = v.e - 2};
+    } else {
+        *minus = (DiyFp) {.f = (v.f << 1) - 1, .e = v.e - 1};
+    }
+    minus->f <<= minus->e - plus->e;
+    minus->e = plus->e;
+}
+
+// cachedPower returns the cached power of 10 that brings a DiyFp with the
+// given binary exponent into the target range, and its decimal exponent.
+static DiyFp cachedPower(int binary_exponent, int *decimal_exponent) {
+    int min_exponent = MIN_TARGET_EXPONENT - (binary_exponent + 64);
+    int k = (int) ceil((min_exponent + 63) * LOG10_2);
+    int index = (CACHED_POWERS_OFFSET + k - 1) / CACHED_POWERS_STEP + 1;
+    
+    const CachedPower *power = &cached_powers[index];
+    *decimal_exponent = power->decimal_exponent;
+    return (DiyFp) {.f = power->significand, .e = power->binary_exponent};
+}
+
+// roundWeed moves the last digit down while that brings the digits closer to
+// the scaled number, and tells whether they are then guaranteed to be the
+// closest shortest digits. All the quantities are scaled by the same factor,
+// unit being the error bound of the scaling.
+static bool roundWeed(char *digits, int length, uint64_t distance_too_high_w, uint64_t unsafe_interval,
+        uint64_t rest, uint64_t ten_kappa, uint64_t unit) {
+    uint64_t small_distance = distance_too_high_w - unit;
+    uint64_t big_distance = distance_too_high_w + unit;
+    
+    while (rest < small_distance && unsafe_interval - rest >= ten_kappa &&
+            (rest + ten_kappa < small_distance || small_distance - rest >= rest + ten_kappa - small_distance)) {
+        digits[length - 1]--;
+        rest += ten_kappa;
+    }
+    
+    if (rest < big_distance && unsafe_interval - rest >= ten_kappa &&
+            (rest + ten_kappa < big_distance || big_distance - rest > rest + ten_kappa - big_distance)) {
+        return false;
+    }
+    
+    return 2 * unit <= rest && rest <= unsafe_interval - 4 * unit;
+}
+
+// generateDigits writes the shortest digits that are between low and high,
+// the scaled boundaries of w, as close as possible to w. kappa is set to
+// the power of 10 of the last digit, relative to the scaling.
+static bool generateDigits(DiyFp low, DiyFp w, DiyFp high, char *digits, int *length, int *kappa) {
+    // The scaled boundaries are off by at most one unit: digits between
+    // too_low and too_high may not read back as the number, the ones in the
+    // unsafe interval between them are only known to be safe if they aren't
+    // too close to its ends.
+    uint64_t unit = 1;
+    DiyFp too_low = {.f = low.f - unit, .e = low.e};
+    DiyFp too_high = {.f = high.f + unit, .e = high.e};
+    uint64_t unsafe_interval = too_high.f - too_low.f;
+    
+    // too_high is split in an integral part, which fits in 32 bits thanks to
+    // the target range, and a fractional part.
+    int shift = -w.e;
+    uint64_t one = (uint64_t) 1 << shift;
+    uint32_t integrals = (uint32_t) (too_high.f >> shift);
+    uint64_t fractionals = too_high.f & (one - 1);
+    
+    uint32_t divisor = 1;
+    *kappa = 1;
+    while (integrals / divisor >= 10) {
+        divisor *= 10;
+        (*kappa)++;
+    }
+    
+    *length = 0;
+    while (*kappa > 0) {
+        digits[(*length)++] = (char) ('0' + integrals / divisor);
+        integrals %= divisor;
+        (*kappa)--;
+        
+        uint64_t rest = ((uint64_t) integrals << shift) + fractionals;
+        if (rest < unsafe_interval) {
+            return roundWeed(digits, *length, too_high.f - w.f, unsafe_interval, rest, (uint64_t) divisor << shift, unit);
+        }
+        divisor /= 10;
+    }
+    
+    for (;;) {
+        fractionals *= 10;
+        unit *= 10;
+        unsafe_interval *= 10;
+        
+        digits[(*length)++] = (char) ('0' + (fractionals >> shift));
+        fractionals &= one - 1;
+        (*kappa)--;
+        
+        if (fractionals < unsafe_interval) {
+            return roundWeed(digits, *length, (too_high.f - w.f) * unit, unsafe_interval, fractionals, one, unit);
+        }
+    }
+}
+
+// grisu3 writes the shortest digits of number, a positive finite double,
+// which is then digits * 10^exponent. Returns false if it can't tell what
+// they are.
+static bool grisu3(double number, char *digits, int *length, int *exponent) {
+    DiyFp w = normalize(diyFpOf(number));
+    DiyFp minus, plus;
+    boundaries(number, &minus, &plus);
+    
+    int power_exponent;
+    DiyFp power = cachedPower(w.e, &power_exponent);
+    
+    int kappa;
+    bool found = generateDigits(multiply(minus, power), multiply(w, power), multiply(plus, power), digits, length, &kappa);
+    *exponent = kappa - power_exponent;
+    return found;
+}
+
+// formatSlowly writes the shortest digits of number, a positive finite
+// double, by trying every precision until one reads back.
+static void formatSlowly(double number, char *digits, int *length, int *exponent) {
+    char buffer[NUMBER_BUFFER_SIZE];
+    for (int precision = 1; precision <= 17; precision++) {
+        snprintf(buffer, sizeof(buffer), "%.*e", precision - 1, number);
+        if (strtod(buffer, NULL) == number) {
+            break;
+        }
+    }
+    
+    // buffer is d[.ddd]e[+-]dd
+    *length = 0;
+    char *c = buffer;
+    for (; *c != 'e'; c++) {
+        if (*c >= '0' && *c <= '9') {
+            digits[(*length)++] = *c;
+        }
+    }
+    *exponent = atoi(c + 1) - (*length - 1);
+}
+
+static char *writeZeros(char *c, int count) {
+    memset(c, '0', count);
+    return c + count;
+}
+
+int FormatNumber(double number, char *buffer) {
+    if (isnan(number)) {
+        strcpy(buffer, "nan");
+        return 3;
+    }
+    
+    char *c = buffer;
+    if (signbit(number)) {
+        *c++ = '-';
+        number = -number;
+    }
+    
+    if (isinf(number)) {
+        strcpy(c, "inf");
+        return (int) (c - buffer) + 3;
+    }
+    if (number == 0) {
+        strcpy(c, "0");
+        return (int) (c - buffer) + 1;
+    }
+    
+    // Grisu3 yields at most 18 digits, before rounding.
+    char digits[20];
+    int length;
+    int exponent;
+    if (!grisu3(number, digits, &length, &exponent)) {
+        formatSlowly(number, digits, &length, &exponent);
+    }
+    while (digits[length - 1] == '0') {
+        length--;
+        exponent++;
+    }
+    
+    // The decimal point is at point digits from the first one.
+    int point = length + exponent;
+    if (length <= point && point <= 21) {
+        memcpy(c, digits, length);
+        c = writeZeros(c + length, point - length);
+    } else if (0 < point && point <= 21) {
+        memcpy(c, digits, point);
+        c += point;
+        *c++ = '.';
+        memcpy(c, digits + point, length - point);
+        c += length - point;
+    } else if (-6 < point && point <= 0) {
+        *c++ = '0';
+        *c++ = '.';
+        c = writeZeros(c, -point);
+        memcpy(c, digits, length);
+        c += length;
+    } else {
+        *c++ = digits[0];
+        if (length > 1) {
+            *c++ = '.';
+            memcpy(c, digits + 1, length - 1);
+            c += length - 1;
+        }
+        c += sprintf(c, "e%+d", point - 1);
+    }
+    
+    *c = '\0';
+    return (int) (c - buffer);
+}
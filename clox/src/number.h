@@ -0,0 +1,20 @@
+#ifndef clox_number_h
+#define clox_number_h
+
+#include "common.h"
+
+// Large enough for any number written by FormatNumber(), '\0' included.
+#define NUMBER_BUFFER_SIZE 32
+
+// ParseNumber returns the double nearest to a number token: digits, with an
+// optional fraction.
+double ParseNumber(const char *start, int length);
+
+// FormatNumber writes to buffer the shortest decimal number that reads back
+// as number, and returns its length. Numbers are written as in JavaScript:
+// in plain notation when their decimal point is between 6 places left of
+// their digits and 21 places from their start, and in scientific notation
+// otherwise (1e+21, 1.5e-7). The output doesn't depend on the locale.
+int FormatNumber(double number, char *buffer);
+
+#endif
@@ -17,114 +17,200 @@ static uint32_t hashString(const char *chars, size_t length) {
         hash *= prime;
     }
     
-    return hash;
+    // 0 means that the hash isn't computed yet, see StringHash().
+    return hash != 0 ? hash : 1;
 }
 
-static Obj *allocateObj(size_t size, ObjType type) {
-    Obj *obj = (Obj*) Reallocate(NULL, 0, size);
+// initObj initialises the header of a new object, which starts young.
+static void initObj(Obj *obj, size_t size, ObjType type) {
     obj->type = type;
     obj->refcount = 0;
+    obj->zct_index = -1;
     obj->marked = false;
-    obj->prev = NULL;
-    obj->next = vm.objects;
-    if (vm.objects != NULL) {
-        vm.objects->prev = obj;
+    obj->old = false;
+    obj->remembered_index = -1;
+    obj->age = 0;
+    obj->immortal = false;
+    vm.young_bytes += size;
+    AddToZct(obj); // Nothing references the new object yet
+    
+    // Objects allocated during an incremental cycle survive it. They're grey
+    // because the fields set by their constructor skip the write barriers.
+    // Strings reference nothing, and may be freed right away if they're
+    // already interned, so they don't go on the grey stack.
+    if (vm.gc_phase == GC_MARKING) {
+        if (type == OBJ_STRING) {
+            obj->marked = true;
+        } else {
+            MarkObj(obj);
+        }
     }
-    vm.objects = obj;
     
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*) obj, size, type);
 #endif
+}
+
+static Obj *allocateObj(size_t size, ObjType type) {
+    Obj *obj = (Obj*) AllocateObjMemory(size);
+    initObj(obj, size, type);
     
     return obj;
 }
 
 #define ALLOCATE_OBJ(type, obj_type) (type*) allocateObj(sizeof(type), obj_type)
 
-Obj *FromString(const char *chars, size_t length) {
-    ObjString *obj = ALLOCATE_FAM(ObjString, char, length + 1);
-    obj->obj.type = OBJ_STRING;
-    obj->obj.refcount = 0;
-    obj->obj.marked = false;
-    obj->obj.prev = NULL;
-    obj->obj.next = vm.objects;
-    if (vm.objects != NULL) {
-        vm.objects->prev = (Obj*) obj;
+uint32_t StringHash(ObjString *string) {
+    if (string->hash == 0) {
+        string->hash = hashString(string->chars, string->length);
     }
-    vm.objects = &obj->obj;
-    
-#ifdef DEBUG_LOG_GC
-    printf("%p allocate %zu for %d\n", (void*) obj, length + 1, OBJ_STRING);
-#endif
+    return string->hash;
+}
 
-    obj->length = length;
-    obj->hash = hashString(chars, length);
+ObjString *InternString(ObjString *string) {
+    if (string->interned) {
+        return string;
+    }
     
-    for (size_t i = 0; i < length; i++) {
-       obj->chars[i] = chars[i];
+    StringHash(string);
+    ObjString *interned = FindString(&vm.strings, string);
+    if (interned != NULL) {
+        // The string table doesn't keep it alive, the caller will.
+        ShadeObj((Obj*) interned);
+        return interned;
     }
+    
+    Push(FromObj((Obj*) string)); // AddString() may trigger a GC cycle
+    AddString(&vm.strings, string);
+    Pop();
+    string->interned = true;
+    
+    return string;
+}
+
+// newString allocates a string of the given length, which isn't interned.
+// The caller fills in its characters.
+static ObjString *newString(size_t length) {
+    ObjString *obj = ALLOCATE_FAM(ObjString, char, length + 1);
+    initObj(&obj->obj, sizeof(ObjString) + length + 1, OBJ_STRING);
+    obj->length = length;
+    obj->hash = 0;
+    obj->interned = false;
     obj->chars[length] = '\0';
     
-    ObjString *interned = Intern(&vm.strings, obj);
-    if (interned != NULL) {
+    return obj;
+}
+
+Obj *FromString(const char *chars, size_t length) {
+    ObjString *obj = newString(length);
+    memcpy(obj->chars, chars, length);
+    
+    ObjString *interned = InternString(obj);
+    if (interned != obj) {
         FreeObj((Obj*) obj);
-        return (Obj*) interned;
     }
-    Push(FromObj((Obj*) obj)); // Insert() may trigger a GC cycle
-    Insert(&vm.strings, obj, FromNil());
-    Pop();
     
-    return (Obj*) obj;
+    return (Obj*) interned;
+}
+
+size_t StringLength(const Obj *string) {
+    if (string->type == OBJ_ROPE) {
+        return ((ObjRope*) string)->length;
+    }
+    return ((ObjString*) string)->length;
 }
 
 Obj *Concatenate(const Obj *left_string, const Obj *right_string) {
-    ObjString *left = (ObjString*) left_string;
-    ObjString *right = (ObjString*) right_string;
-    
-    size_t length = left->length + right ->length;
-    ObjString *obj = ALLOCATE_FAM(ObjString, char, length + 1);
-    obj->obj.type = OBJ_STRING;
-    obj->obj.marked = false;
-    obj->obj.refcount = 0;
-    obj->obj.prev = NULL;
-    obj->obj.next = vm.objects;
-    if (vm.objects != NULL) {
-        vm.objects->prev = (Obj*) obj;
+    // Flattened ropes are replaced by their characters, so that a rope
+    // doesn't keep alive the ropes it was built from.
+    Obj *left = (Obj*) left_string;
+    Obj *right = (Obj*) right_string;
+    if (left->type == OBJ_ROPE && ((ObjRope*) left)->flat != NULL) {
+        left = (Obj*) ((ObjRope*) left)->flat;
+    }
+    if (right->type == OBJ_ROPE && ((ObjRope*) right)->flat != NULL) {
+        right = (Obj*) ((ObjRope*) right)->flat;
     }
-    vm.objects = &obj->obj;
     
-#ifdef DEBUG_LOG_GC
-    printf("%p allocate %zu for %d\n", (void*) obj, length + 1, OBJ_STRING);
-#endif
+    size_t length = StringLength(left) + StringLength(right);
+    if (length >= ROPE_MIN_LENGTH) {
+        ObjRope *rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+        rope->length = length;
+        rope->left = left; IncrementRefcountObject(left);
+        rope->right = right; IncrementRefcountObject(right);
+        rope->flat = NULL;
+        return (Obj*) rope;
+    }
     
-    obj->length = length;
+    // Both strings are shorter than a rope, so they're flat.
+    ObjString *left_flat = (ObjString*) left;
+    ObjString *right_flat = (ObjString*) right;
+    ObjString *obj = newString(length);
+    memcpy(obj->chars, left_flat->chars, left_flat->length);
+    memcpy(obj->chars + left_flat->length, right_flat->chars, right_flat->length);
     
-    char *c = obj->chars;
-    for (size_t i = 0; i < left->length; i++) {
-       *c++ = left->chars[i]; 
+    return (Obj*) obj;
+}
+
+ObjString *Flatten(Obj *string) {
+    if (string->type == OBJ_STRING) {
+        return (ObjString*) string;
     }
-    for (size_t i = 0; i < right->length; i++) {
-       *c++ = right->chars[i]; 
+    
+    ObjRope *rope = (ObjRope*) string;
+    if (rope->flat != NULL) {
+        return rope->flat;
     }
-    *c = '\0';
     
-    obj->hash = hashString(obj->chars, obj->length);
+    ObjString *obj = newString(rope->length);
     
-    ObjString *interned = Intern(&vm.strings, obj);
-    if (interned != NULL) {
-        FreeObj((Obj*) obj);
-        return (Obj*) interned;
+    // The pieces are copied from the end, right child first. Ropes built by
+    // appending in a loop lean left, so the stack of pending left children
+    // stays short. The stack doesn't go through Reallocate(), which could
+    // trigger a GC cycle.
+    Obj **stack = NULL;
+    int stack_count = 0;
+    int stack_capacity = 0;
+    size_t end = obj->length;
+    Obj *node = (Obj*) rope;
+    for (;;) {
+        if (node->type == OBJ_ROPE && ((ObjRope*) node)->flat == NULL) {
+            if (stack_count == stack_capacity) {
+                stack_capacity = GROW_CAPACITY(stack_capacity);
+                stack = (Obj**) realloc(stack, stack_capacity * sizeof(Obj*));
+                if (stack == NULL) {
+                    exit(1);
+                }
+            }
+            stack[stack_count++] = ((ObjRope*) node)->left;
+            node = ((ObjRope*) node)->right;
+            continue;
+        }
+        
+        ObjString *piece = node->type == OBJ_ROPE ? ((ObjRope*) node)->flat : (ObjString*) node;
+        end -= piece->length;
+        memcpy(obj->chars + end, piece->chars, piece->length);
+        
+        if (stack_count == 0) {
+            break;
+        }
+        node = stack[--stack_count];
     }
-    Push(FromObj((Obj*) obj)); // Insert() may trigger a GC cycle
-    Insert(&vm.strings, obj, FromNil());
-    Pop();
+    free(stack);
     
-    return (Obj*) obj;
+    rope->flat = obj; IncrementRefcountObject((Obj*) obj);
+    WriteBarrier((Obj*) rope, FromObj((Obj*) obj));
+    DecrementRefcountObject(rope->left);
+    DecrementRefcountObject(rope->right);
+    rope->left = NULL;
+    rope->right = NULL;
+    
+    return obj;
 }
 
 ObjUpvalue *NewUpvalue(Value *slot) {
     ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
-    upvalue->location = slot; IncrementRefcountValue(*slot);
+    upvalue->location = slot; // Stack slots aren't counted until the upvalue is closed
     upvalue->closed = FromNil();
     upvalue->next = NULL;
     
@@ -135,6 +221,8 @@ ObjFunction *NewFunction() {
     ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalue_count = 0;
+    function->stack_size = 0;
+    function->linked = true;
     InitChunk(&function->chunk);
     function->name = NULL;
     
@@ -169,18 +257,117 @@ ObjClass *NewClass(ObjString *name) {
     ObjClass *class = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     class->name = name; IncrementRefcountObject((Obj*) name);
     InitTable(&class->methods);
+    class->version = 0;
+    class->instance_slots = 0;
     
     return class;
 }
 
 ObjInstance *NewInstance(ObjClass *class) {
+    // We allocate the slots before creating the instance to please the GC.
+    int slot_capacity = class->instance_slots;
+    Value *slots = ALLOCATE(Value, slot_capacity);
+    
     ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     instance->class = class; IncrementRefcountObject((Obj*) class);
+    instance->shape = vm.root_shape; IncrementRefcountShape(vm.root_shape);
+    instance->slots = slots;
+    instance->slot_capacity = slot_capacity;
     InitTable(&instance->fields);
     
     return instance;
 }
 
+bool GetField(ObjInstance *instance, ObjString *name, Value *value) {
+    if (instance->shape == NULL) {
+        return Get(&instance->fields, name, value);
+    }
+    
+    int slot = ShapeSlot(instance->shape, name);
+    if (slot < 0) {
+        return false;
+    }
+    *value = instance->slots[slot];
+    return true;
+}
+
+// toDictionaryMode moves the fields of the instance from its slots to its
+// fields table.
+static void toDictionaryMode(ObjInstance *instance) {
+    Shape *shape = instance->shape;
+    
+    // Insert() might trigger a GC cycle, so we keep the instance in shape mode
+    // until all the fields are in the table. The GC marks both.
+    for (int i = 0; i < shape->count; i++) {
+        Insert(&instance->fields, shape->names[i], instance->slots[i]);
+    }
+    
+    instance->shape = NULL;
+    for (int i = 0; i < shape->count; i++) {
+        DecrementRefcountValue(instance->slots[i]);
+    }
+    DecrementRefcountShape(shape);
+    FREE_ARRAY(Value, instance->slots, instance->slot_capacity);
+    instance->slots = NULL;
+    instance->slot_capacity = 0;
+}
+
+void SetField(ObjInstance *instance, ObjString *name, Value value) {
+    if (instance->shape == NULL) {
+        Insert(&instance->fields, name, value);
+        WriteBarrier((Obj*) instance, FromObj((Obj*) name));
+        WriteBarrier((Obj*) instance, value);
+        return;
+    }
+    
+    int slot = ShapeSlot(instance->shape, name);
+    if (slot >= 0) {
+        Value old = instance->slots[slot];
+        instance->slots[slot] = value; IncrementRefcountValue(value);
+        DecrementRefcountValue(old);
+        WriteBarrier((Obj*) instance, value);
+        return;
+    }
+    
+    Shape *shape = ShapeTransition(instance->shape, name);
+    if (shape == NULL) {
+        toDictionaryMode(instance);
+        Insert(&instance->fields, name, value);
+        WriteBarrier((Obj*) instance, FromObj((Obj*) name));
+        WriteBarrier((Obj*) instance, value);
+        return;
+    }
+    
+    if (shape->count > instance->slot_capacity) {
+        int capacity = instance->slot_capacity < 4 ? 4 : instance->slot_capacity * 2;
+        instance->slots = GROW_ARRAY(Value, instance->slots, instance->slot_capacity, capacity);
+        instance->slot_capacity = capacity;
+    }
+    
+    instance->slots[shape->count - 1] = value; IncrementRefcountValue(value);
+    IncrementRefcountShape(shape);
+    DecrementRefcountShape(instance->shape);
+    instance->shape = shape;
+    // The instance marks the names of its shape, see MarkShape().
+    WriteBarrier((Obj*) instance, FromObj((Obj*) name));
+    WriteBarrier((Obj*) instance, value);
+    
+    if (shape->count > instance->class->instance_slots) {
+        instance->class->instance_slots = shape->count;
+    }
+}
+
+void RemoveField(ObjInstance *instance, ObjString *name) {
+    if (instance->shape != NULL) {
+        if (ShapeSlot(instance->shape, name) < 0) {
+            return;
+        }
+        toDictionaryMode(instance);
+    }
+    
+    Remove(&instance->fields, name);
+}
+
 ObjBoundMethod *NewBoundMethod(Value receiver, ObjClosure *method) {
     ObjBoundMethod *bound_method = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
     bound_method->receiver = receiver; IncrementRefcountValue(receiver);
@@ -189,13 +376,34 @@ ObjBoundMethod *NewBoundMethod(Value receiver, ObjClosure *method) {
     return bound_method;
 }
 
+static bool stringsEqual(ObjString *a, ObjString *b) {
+    if (a == b) {
+        return true;
+    }
+    if (a->interned && b->interned) {
+        return false;
+    }
+    
+    return a->length == b->length &&
+        StringHash(a) == StringHash(b) &&
+        memcmp(a->chars, b->chars, a->length) == 0;
+}
+
 bool ObjsEqual(const Obj *a, const Obj *b) {
+    if (a->type == OBJ_ROPE || b->type == OBJ_ROPE) {
+        if (!IsString(FromObj((Obj*) a)) || !IsString(FromObj((Obj*) b))) {
+            return false;
+        }
+        // Both are on the stack, Flatten() may trigger a GC cycle.
+        return stringsEqual(Flatten((Obj*) a), Flatten((Obj*) b));
+    }
+    
     if (a->type != b->type) {
         return false;
     }
     
     if (a->type == OBJ_STRING) {
-        return a == b;
+        return stringsEqual((ObjString*) a, (ObjString*) b);
     }
     
     if (a->type == OBJ_NATIVE) {
@@ -206,33 +414,24 @@ bool ObjsEqual(const Obj *a, const Obj *b) {
 }
 
 void FreeObj(Obj *obj) {
-    #ifdef DEBUG_LOG_GC
-        printf("freeing ");
-        PrintObj(obj);
-        printf(" at address %p\n", (void*) obj);
-    #endif
-    
-    // During GC cycles, FreeObj() is called on objects with refcount > 0.
-    // Outside GC cycles, FreeObj() should only be called when the object's refcount reaches 0.
-    obj->refcount = 0;
-
-    // Removes the object from the vm.objects linked list.
-    Obj *prev = obj->prev;
-    Obj *next = obj->next;
-    if (prev != NULL) {
-        prev->next = next;
-    }
-    if (next != NULL) {
-        next->prev = prev;
-    }
-    if (vm.objects == obj) {
-        vm.objects = next;
-    }
+    ReleaseObj(obj);
+    FreeReleasedObj(obj);
+}
 
+void ReleaseObj(Obj *obj) {
     switch (obj->type) {
         case OBJ_STRING:
-            FREE(ObjString, obj);
             break;
+        case OBJ_ROPE: {
+            ObjRope *rope = (ObjRope*) obj;
+            if (rope->flat != NULL) {
+                DecrementRefcountObject((Obj*) rope->flat);
+            } else {
+                DecrementRefcountObject(rope->left);
+                DecrementRefcountObject(rope->right);
+            }
+            break;
+        }
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction*) obj;
             if (function->name != NULL) {
@@ -240,11 +439,9 @@ void FreeObj(Obj *obj) {
                 DecrementRefcountObject((Obj*) function->name);
             }
             FreeChunk(&function->chunk);
-            FREE(ObjFunction, function);
             break;
         }
         case OBJ_NATIVE:
-            FREE(ObjNative, obj);
             break;
         case OBJ_CLOSURE: {
             ObjClosure *closure = (ObjClosure*) obj;
@@ -260,39 +457,88 @@ void FreeObj(Obj *obj) {
             }
             
             FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalue_count);
-            FREE(ObjClosure, obj);
             break;
         }
         case OBJ_UPVALUE: {
             ObjUpvalue *upvalue = (ObjUpvalue*) obj;
             
             // Don't free the variable because multiple closures may close over it.
-            DecrementRefcountValue(*upvalue->location);
-            
-            FREE(ObjUpvalue, obj);
+            if (upvalue->location == &upvalue->closed) {
+                DecrementRefcountValue(upvalue->closed);
+            }
             break;
         }
         case OBJ_CLASS: {
             ObjClass *class = (ObjClass*) obj;
             DecrementRefcountObject((Obj*) class->name);
             FreeTable(&class->methods);
-            FREE(ObjClass, obj);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance*) obj;
             DecrementRefcountObject((Obj*) instance->class);
+            if (instance->shape != NULL) {
+                for (int i = 0; i < instance->shape->count; i++) {
+                    DecrementRefcountValue(instance->slots[i]);
+                }
+                DecrementRefcountShape(instance->shape);
+            }
+            FREE_ARRAY(Value, instance->slots, instance->slot_capacity);
             FreeTable(&instance->fields);
-            FREE(ObjInstance, obj);
             break;
         }
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod *bound_method = (ObjBoundMethod*) obj;
             DecrementRefcountValue(bound_method->receiver);
             DecrementRefcountObject((Obj*) bound_method->method);
-            FREE(ObjBoundMethod, obj);
             break;
         }
+        default:
+            printf("Releasing object at %p of invalid object type %d\n", (void*) obj, obj->type);
+            exit(1);
+    }
+}
+
+void FreeReleasedObj(Obj *obj) {
+    #ifdef DEBUG_LOG_GC
+        printf("freeing object of type %d at address %p\n", obj->type, (void*) obj);
+    #endif
+    
+    if (obj->zct_index >= 0) {
+        RemoveFromZct(obj);
+    }
+    if (obj->remembered_index >= 0) {
+        Forget(obj);
+    }
+
+    switch (obj->type) {
+        case OBJ_STRING:
+            FreeObjMemory(obj, sizeof(ObjString) + ((ObjString*) obj)->length + 1);
+            break;
+        case OBJ_ROPE:
+            FREE_OBJ(ObjRope, obj);
+            break;
+        case OBJ_FUNCTION:
+            FREE_OBJ(ObjFunction, obj);
+            break;
+        case OBJ_NATIVE:
+            FREE_OBJ(ObjNative, obj);
+            break;
+        case OBJ_CLOSURE:
+            FREE_OBJ(ObjClosure, obj);
+            break;
+        case OBJ_UPVALUE:
+            FREE_OBJ(ObjUpvalue, obj);
+            break;
+        case OBJ_CLASS:
+            FREE_OBJ(ObjClass, obj);
+            break;
+        case OBJ_INSTANCE:
+            FREE_OBJ(ObjInstance, obj);
+            break;
+        case OBJ_BOUND_METHOD:
+            FREE_OBJ(ObjBoundMethod, obj);
+            break;
         default:
             printf("Freeing object at %p of invalid object type %d\n", (void*) obj, obj->type);
             exit(1);
@@ -304,50 +550,96 @@ void PrintObj(const Obj *obj) {
 }
 
 void FPrintObj(FILE *stream, const Obj *obj) {
+    char buffer[256];
+    Output output;
+    InitOutput(&output, stream, buffer, sizeof(buffer), false);
+    WriteObj(&output, obj);
+    FlushOutput(&output);
+}
+
+// writeRope writes the pieces of rope in order, without flattening it: the GC
+// prints objects while it runs, and writing must not change the heap. The
+// stack of pending right children doesn't go through Reallocate(), which
+// could trigger a GC cycle.
+static void writeRope(Output *output, const ObjRope *rope) {
+    const Obj **stack = NULL;
+    int stack_count = 0;
+    int stack_capacity = 0;
+    const Obj *node = (const Obj*) rope;
+    for (;;) {
+        if (node->type == OBJ_ROPE && ((const ObjRope*) node)->flat == NULL) {
+            if (stack_count == stack_capacity) {
+                stack_capacity = GROW_CAPACITY(stack_capacity);
+                stack = (const Obj**) realloc(stack, stack_capacity * sizeof(Obj*));
+                if (stack == NULL) {
+                    exit(1);
+                }
+            }
+            stack[stack_count++] = ((const ObjRope*) node)->right;
+            node = ((const ObjRope*) node)->left;
+            continue;
+        }
+        
+        const ObjString *piece = node->type == OBJ_ROPE ? ((const ObjRope*) node)->flat : (const ObjString*) node;
+        WriteOutput(output, piece->chars, piece->length);
+        
+        if (stack_count == 0) {
+            break;
+        }
+        node = stack[--stack_count];
+    }
+    free(stack);
+}
+
+void WriteObj(Output *output, const Obj *obj) {
     switch (obj->type) {
         case OBJ_STRING: {
             ObjString *objs = (ObjString*) obj;
-            fprintf(stream, "%s", objs->chars);
+            WriteOutput(output, objs->chars, objs->length);
             break;
         }
+        case OBJ_ROPE:
+            writeRope(output, (const ObjRope*) obj);
+            break;
         case OBJ_FUNCTION:
         case OBJ_CLOSURE:
         case OBJ_BOUND_METHOD: {
             ObjFunction *function;
             if (obj->type == OBJ_FUNCTION) {
                 function = (ObjFunction*) obj;
-                fprintf(stream, "<fn ");
+                WriteOutputString(output, "<fn ");
             } else if (obj->type == OBJ_CLOSURE) {
                 function = ((ObjClosure*) obj)->function;
-                fprintf(stream, "<closure ");
+                WriteOutputString(output, "<closure ");
             } else {
                 function = ((ObjBoundMethod*) obj)->method->function;
-                fprintf(stream, "<method ");
+                WriteOutputString(output, "<method ");
             }
             
             if (function->name == NULL) {
-                fprintf(stream, " script>");
+                WriteOutputString(output, " script>");
                 break;
             }
-            fprintf(stream, "%s>", function->name->chars); 
+            WriteOutput(output, function->name->chars, function->name->length);
+            WriteOutputString(output, ">");
             break;
         }
         case OBJ_NATIVE:
-            fprintf(stream, "<native>");
+            WriteOutputString(output, "<native>");
             break;
         case OBJ_UPVALUE:
-            printf("upvalue");
+            WriteOutputString(output, "upvalue");
             break;
         case OBJ_CLASS: {
-            printf("<class ");
-            FPrintObj(stream, (Obj*) ((ObjClass*) obj)->name);
-            printf(">");
+            WriteOutputString(output, "<class ");
+            WriteObj(output, (Obj*) ((ObjClass*) obj)->name);
+            WriteOutputString(output, ">");
             break;
         }
         case OBJ_INSTANCE: {
-            printf("<instance ");
-            FPrintObj(stream, (Obj*) ((ObjInstance*) obj)->class->name);
-            printf(">");
+            WriteOutputString(output, "<instance ");
+            WriteObj(output, (Obj*) ((ObjInstance*) obj)->class->name);
+            WriteOutputString(output, ">");
             break;
         }
         default:
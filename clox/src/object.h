@@ -5,11 +5,13 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "shape.h"
 #include "table.h"
 #include "value.h"
 
 typedef enum {
     OBJ_STRING,
+    OBJ_ROPE,
     OBJ_FUNCTION,
     OBJ_NATIVE,
     OBJ_CLOSURE,
@@ -23,22 +25,57 @@ struct Obj {
    ObjType type; 
    
    // GC related fields
-   int refcount;
+   int refcount; // Number of references from the heap, stack slots aren't counted
+   int zct_index; // Index of the object in vm.zct, or -1 if it isn't there
+   int remembered_index; // Index of the object in vm.remembered, or -1
    bool marked;
-   struct Obj *prev;
-   struct Obj *next;
+   bool old; // Whether the object is in the old generation or in the young one
+   uint8_t age; // Number of minor collections survived
+   // Whether the object lives in a read-only bytecode image (see bytecode.h).
+   // It's never freed nor written to, so its refcount isn't maintained.
+   bool immortal;
 };
 
+// Strings created by the compiler are interned in vm.strings, so they can be
+// compared by address. Strings created at runtime aren't, until they are used
+// as a table key (see InternString()), and their hash is computed lazily.
 struct ObjString {
     Obj obj;
     size_t length;
-    uint32_t hash;
+    uint32_t hash; // 0 until computed, see StringHash()
+    bool interned;
     // Flexible array member: https://www.wikiwand.com/en/Flexible_array_member
     char chars[];
 };
 
+// Concatenations at least this long make ropes instead of flat strings.
+#define ROPE_MIN_LENGTH 64
+
+// ObjRope is a string made by concatenating two strings, flat or not,
+// without copying them. Its characters are only gathered in a flat string by
+// Flatten(), when something needs them.
+typedef struct {
+    Obj obj;
+    size_t length;
+    Obj *left; // NULL once flattened
+    Obj *right; // NULL once flattened
+    ObjString *flat; // NULL until flattened
+} ObjRope;
+
 Obj *FromString(const char *chars, size_t length);
+uint32_t StringHash(ObjString *string);
+// InternString returns the interned string with the characters of string,
+// which becomes it if there's none. It may trigger a GC cycle.
+ObjString *InternString(ObjString *string);
 Obj *Concatenate(const Obj *left_string, const Obj *right_string);
+size_t StringLength(const Obj *string);
+
+// Flatten returns the flat string with the characters of string, which is
+// either an ObjString or an ObjRope. It may trigger a GC cycle. The flat
+// string of a rope isn't interned.
+ObjString *Flatten(Obj *string);
+
+// IsString is true for both flat strings and ropes.
 static inline bool IsString(Value value);
 
 typedef struct ObjUpvalue {
@@ -54,6 +91,12 @@ typedef struct {
     Obj obj;
     int arity;
     int upvalue_count;
+    // Stack slots a frame running the function can use, from the callee and
+    // its arguments up to the deepest point of its code.
+    int stack_size;
+    // False for the functions of a bytecode image until their code is
+    // checked, the first time they are called (see LinkFunction()).
+    bool linked;
     Chunk chunk;
     ObjString *name;
 } ObjFunction;
@@ -82,10 +125,18 @@ typedef struct {
 ObjNative *NewNative(NativeFn function, int arity);
 static inline bool IsNative(Value value);
 
-typedef struct {
+typedef struct ObjClass {
     Obj obj;
     ObjString *name;
     Table methods;
+    
+    // Incremented every time methods changes, so that inline caches holding
+    // one of the class' methods can tell they are stale.
+    int version;
+    
+    // Number of slots preallocated for new instances: the largest number of
+    // fields an instance of the class has had so far.
+    int instance_slots;
 } ObjClass;
 
 ObjClass *NewClass(ObjString *name);
@@ -94,10 +145,31 @@ static inline bool IsClass(Value value);
 typedef struct {
     Obj obj;
     ObjClass *class;
+    
+    // The instance's fields are stored in one of two ways:
+    // - Shape mode: shape describes the fields and their values are in slots.
+    // - Dictionary mode: shape is NULL and the fields are in the fields table.
+    //   Instances switch to dictionary mode when a field is removed or when
+    //   they get too many fields.
+    Shape *shape;
+    Value *slots;
+    int slot_capacity;
     Table fields;
 } ObjInstance;
 
 ObjInstance *NewInstance(ObjClass *class);
+
+// GetField retrieves the value of a field of the instance.
+//
+// Returns true iff the instance has the field, in which case its value is
+// stored in value.
+bool GetField(ObjInstance *instance, ObjString *name, Value *value);
+
+// SetField sets the value of a field of the instance, adding it if needed.
+void SetField(ObjInstance *instance, ObjString *name, Value value);
+
+// RemoveField removes a field from the instance, if it has it.
+void RemoveField(ObjInstance *instance, ObjString *name);
 static inline bool IsInstance(Value value);
 
 typedef struct {
@@ -110,36 +182,45 @@ ObjBoundMethod *NewBoundMethod(Value receiver, ObjClosure *method);
 static inline bool IsBoundMethod(Value value);
 
 bool ObjsEqual(const Obj *a, const Obj *b);
+// FreeObj releases obj (see ReleaseObj) and frees it.
 void FreeObj(Obj *obj);
+// ReleaseObj drops the references obj holds to other objects and frees the
+// memory it owns, but not obj itself. When freeing many objects that may
+// reference each other, releasing all of them before freeing any of them
+// avoids decrementing the refcount of an object that is already freed.
+void ReleaseObj(Obj *obj);
+// FreeReleasedObj frees an object already released with ReleaseObj().
+void FreeReleasedObj(Obj *obj);
+void WriteObj(Output *output, const Obj *obj);
 void PrintObj(const Obj *obj);
 void FPrintObj(FILE *stream, const Obj *obj);
 
 static inline bool IsString(Value value) {
-    return value.type == VAL_OBJ && value.as.obj->type == OBJ_STRING;
+    return IsObj(value) && (AsObj(value)->type == OBJ_STRING || AsObj(value)->type == OBJ_ROPE);
 }
 
 static inline bool IsFunction(Value value) {
-    return value.type == VAL_OBJ && value.as.obj->type == OBJ_FUNCTION;
+    return IsObj(value) && AsObj(value)->type == OBJ_FUNCTION;
 }
 
 static inline bool IsClosure(Value value) {
-    return value.type == VAL_OBJ && value.as.obj->type == OBJ_CLOSURE;
+    return IsObj(value) && AsObj(value)->type == OBJ_CLOSURE;
 }
 
 static inline bool IsNative(Value value) {
-    return value.type == VAL_OBJ && value.as.obj->type == OBJ_NATIVE;
+    return IsObj(value) && AsObj(value)->type == OBJ_NATIVE;
 }
 
 static inline bool IsClass(Value value) {
-    return value.type == VAL_OBJ && value.as.obj->type == OBJ_CLASS;
+    return IsObj(value) && AsObj(value)->type == OBJ_CLASS;
 }
 
 static inline bool IsInstance(Value value) {
-    return value.type == VAL_OBJ && value.as.obj->type == OBJ_INSTANCE;
+    return IsObj(value) && AsObj(value)->type == OBJ_INSTANCE;
 }
 
 static inline bool IsBoundMethod(Value value) {
-    return value.type == VAL_OBJ && value.as.obj->type == OBJ_BOUND_METHOD;
+    return IsObj(value) && AsObj(value)->type == OBJ_BOUND_METHOD;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,389 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "optimizer.h"
+
+typedef struct {
+    int offset; // Offset of the instruction in the original code
+    int length; // Length of the instruction once rewritten
+    uint8_t op;
+    int target; // Index of the instruction a jump goes to
+    int pops; // Number of values popped by OP_POP and OP_POPN
+    bool deleted;
+    bool is_target; // Whether a jump goes to the instruction
+    bool reachable;
+} Instruction;
+
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE;
+}
+
+static int jumpDestination(Chunk *chunk, int offset) {
+    int16_t jump = (int16_t) (chunk->code[offset + 1] | chunk->code[offset + 2] << 8);
+    return offset + 3 + jump;
+}
+
+// nextKept returns the index of the first instruction from i on that isn't
+// deleted, or count if there's none.
+static int nextKept(Instruction *instrs, int count, int i) {
+    while (i < count && instrs[i].deleted) {
+        i++;
+    }
+    return i;
+}
+
+// threadJump makes the jump at index i go to the final destination of a
+// chain of jumps. A conditional jump can skip a jump of the same kind, since
+// the condition it leaves on the stack makes that one jump too.
+static void threadJump(Instruction *instrs, int count, int i) {
+    Instruction *jump = &instrs[i];
+    for (int hops = 0; hops < count; hops++) {
+        int target = nextKept(instrs, count, jump->target);
+        if (target == count) {
+            return;
+        }
+        
+        Instruction *next = &instrs[target];
+        if (next->op != OP_JUMP && next->op != jump->op) {
+            return;
+        }
+        if (next == jump) {
+            return;
+        }
+        jump->target = next->target;
+    }
+}
+
+// markReachable marks the instructions that the code can reach from its
+// start, following jumps.
+static void markReachable(Instruction *instrs, int count) {
+    int *worklist = ALLOCATE(int, count);
+    int worklist_count = 0;
+    
+    instrs[0].reachable = true;
+    worklist[worklist_count++] = 0;
+    while (worklist_count > 0) {
+        int i = worklist[--worklist_count];
+        int successors[2];
+        int successor_count = 0;
+        
+        uint8_t op = instrs[i].op;
+        if (op != OP_RETURN && op != OP_JUMP && i + 1 < count) {
+            successors[successor_count++] = i + 1;
+        }
+        if (isJump(op) && instrs[i].target < count) {
+            successors[successor_count++] = instrs[i].target;
+        }
+        
+        for (int j = 0; j < successor_count; j++) {
+            Instruction *successor = &instrs[successors[j]];
+            if (!successor->reachable) {
+                successor->reachable = true;
+                worklist[worklist_count++] = successors[j];
+            }
+        }
+    }
+    
+    FREE_ARRAY(int, worklist, count);
+}
+
+static void markTargets(Instruction *instrs, int count) {
+    for (int i = 0; i < count; i++) {
+        instrs[i].is_target = false;
+    }
+    for (int i = 0; i < count; i++) {
+        if (!instrs[i].deleted && isJump(instrs[i].op)) {
+            int target = nextKept(instrs, count, instrs[i].target);
+            if (target < count) {
+                instrs[target].is_target = true;
+            }
+        }
+    }
+}
+
+static void rewrite(Chunk *chunk, Instruction *instrs, int count) {
+    // Deleted instructions take the offset of the next one kept, so jumps to
+    // them land there.
+    int *new_offsets = ALLOCATE(int, count + 1);
+    int new_count = 0;
+    for (int i = 0; i < count; i++) {
+        new_offsets[i] = new_count;
+        if (!instrs[i].deleted) {
+            new_count += instrs[i].length;
+        }
+    }
+    new_offsets[count] = new_count;
+    
+    int *lines = ALLOCATE(int, chunk->count);
+    int offset = 0;
+    for (int i = 0; i < chunk->lines.count; i++) {
+        for (int j = 0; j < chunk->lines.lengths[i]; j++) {
+            lines[offset++] = chunk->lines.lines[i];
+        }
+    }
+    
+    uint8_t *code = ALLOCATE(uint8_t, new_count);
+    Lines new_lines;
+    InitLines(&new_lines);
+    for (int i = 0; i < count; i++) {
+        Instruction *instr = &instrs[i];
+        if (instr->deleted) {
+            continue;
+        }
+        
+        uint8_t *dst = &code[new_offsets[i]];
+        if (isJump(instr->op)) {
+            int16_t jump = (int16_t) (new_offsets[instr->target] - new_offsets[i] - 3);
+            dst[0] = instr->op;
+            dst[1] = jump & 0xFF; // little endian
+            dst[2] = (jump >> 8) & 0xFF;
+        } else if (instr->op == OP_POP || instr->op == OP_POPN) {
+            dst[0] = instr->op;
+            if (instr->op == OP_POPN) {
+                dst[1] = (uint8_t) instr->pops;
+            }
+        } else {
+            memcpy(dst, &chunk->code[instr->offset], instr->length);
+        }
+        
+        for (int j = 0; j < instr->length; j++) {
+            WriteLines(&new_lines, lines[instr->offset]);
+        }
+    }
+    
+    memcpy(chunk->code, code, new_count);
+    chunk->count = new_count;
+    FreeLines(&chunk->lines);
+    chunk->lines = new_lines;
+    
+    FREE_ARRAY(uint8_t, code, new_count);
+    FREE_ARRAY(int, lines, offset);
+    FREE_ARRAY(int, new_offsets, count + 1);
+}
+
+void OptimizeChunk(Chunk *chunk) {
+    if (chunk->count == 0) {
+        return;
+    }
+    
+    int code_count = chunk->count;
+    int *indices = ALLOCATE(int, code_count + 1); // Instruction index by offset, or -1
+    Instruction *instrs = ALLOCATE(Instruction, code_count);
+    for (int offset = 0; offset <= code_count; offset++) {
+        indices[offset] = -1;
+    }
+    
+    int count = 0;
+    for (int offset = 0; offset < chunk->count; count++) {
+        Instruction *instr = &instrs[count];
+        instr->offset = offset;
+        instr->length = InstructionLength(chunk, offset);
+        instr->op = chunk->code[offset];
+        instr->target = -1;
+        instr->pops = instr->op == OP_POP ? 1 : instr->op == OP_POPN ? chunk->code[offset + 1] : 0;
+        instr->deleted = false;
+        instr->reachable = false;
+        indices[offset] = count;
+        offset += instr->length;
+    }
+    indices[code_count] = count;
+    
+    for (int i = 0; i < count; i++) {
+        if (!isJump(instrs[i].op)) {
+            continue;
+        }
+        
+        int destination = jumpDestination(chunk, instrs[i].offset);
+        if (destination < 0 || destination > code_count || indices[destination] < 0) {
+            // Not code the compiler would emit, leave it alone.
+            goto done;
+        }
+        instrs[i].target = indices[destination];
+    }
+    markTargets(instrs, count);
+    
+    // OP_NOT; OP_JUMP_IF_FALSE becomes OP_JUMP_IF_TRUE. The condition left
+    // on the stack is then the opposite, which is fine when it's popped right
+    // away on both paths.
+    for (int i = 0; i + 2 < count; i++) {
+        Instruction *jump = &instrs[i + 1];
+        if (instrs[i].op == OP_NOT && jump->op == OP_JUMP_IF_FALSE && !jump->is_target &&
+            instrs[i + 2].op == OP_POP && jump->target < count && instrs[jump->target].op == OP_POP) {
+            instrs[i].deleted = true;
+            jump->op = OP_JUMP_IF_TRUE;
+        }
+    }
+    
+    for (int i = 0; i < count; i++) {
+        if (!instrs[i].deleted && isJump(instrs[i].op)) {
+            threadJump(instrs, count, i);
+        }
+    }
+    
+    markReachable(instrs, count);
+    for (int i = 0; i < count; i++) {
+        if (!instrs[i].reachable) {
+            instrs[i].deleted = true;
+        }
+    }
+    
+    // A jump to the next instruction does nothing: conditional jumps don't
+    // pop their condition.
+    for (int i = 0; i < count; i++) {
+        if (!instrs[i].deleted && isJump(instrs[i].op) &&
+            nextKept(instrs, count, instrs[i].target) == nextKept(instrs, count, i + 1)) {
+            instrs[i].deleted = true;
+        }
+    }
+    
+    // Runs of pops merge into their first instruction, unless a jump goes
+    // into the middle of the run.
+    markTargets(instrs, count);
+    for (int i = 0; i < count; i++) {
+        Instruction *first = &instrs[i];
+        if (first->deleted || first->pops == 0) {
+            continue;
+        }
+        
+        int j = nextKept(instrs, count, i + 1);
+        while (j < count && instrs[j].pops > 0 && !instrs[j].is_target &&
+               first->pops + instrs[j].pops <= UINT8_MAX) {
+            first->pops += instrs[j].pops;
+            instrs[j].deleted = true;
+            j = nextKept(instrs, count, j + 1);
+        }
+        first->op = first->pops == 1 ? OP_POP : OP_POPN;
+        first->length = first->pops == 1 ? 1 : 2;
+        i = j - 1;
+    }
+    
+    rewrite(chunk, instrs, count);
+    
+done:
+    FREE_ARRAY(Instruction, instrs, code_count);
+    FREE_ARRAY(int, indices, code_count + 1);
+}
+
+// stackEffect returns the number of values the instruction at offset pushes
+// minus the number it pops. Calls count the value they return, the frame of
+// the callee reserves its own stack.
+static int stackEffect(Chunk *chunk, int offset) {
+    uint8_t *code = &chunk->code[offset];
+    switch (code[0]) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_IDENT_GLOBAL:
+        case OP_IDENT_LOCAL:
+        case OP_IDENT_UPVALUE:
+        case OP_DUPLICATE:
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:
+            return 1;
+        case OP_EQ:
+        case OP_NEQ:
+        case OP_LESS:
+        case OP_LESS_EQ:
+        case OP_GREATER:
+        case OP_GREATER_EQ:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_LESS_NUM:
+        case OP_LESS_EQ_NUM:
+        case OP_GREATER_NUM:
+        case OP_GREATER_EQ_NUM:
+        case OP_PRINT:
+        case OP_POP:
+        case OP_VAR_DECL:
+        case OP_CLOSE_UPVALUE:
+        case OP_INHERIT:
+            return -1;
+        case OP_ASSIGN_PROPERTY:
+        case OP_METHOD:
+        case OP_GET_SUPER:
+            return -2;
+        case OP_POPN:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return -code[1];
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            return -code[2];
+        case OP_INVOKE_LONG:
+        case OP_TAIL_INVOKE_LONG:
+            return -code[4];
+        default:
+            return 0;
+    }
+}
+
+int MaxStackDepth(Chunk *chunk) {
+    // depths[i] is the depth before the instruction at offset i, or -1 until
+    // a path reaches it. Each offset is pushed on the worklist once. Both
+    // bypass Reallocate() so that no GC cycle runs before the function is
+    // rooted.
+    int *depths = malloc(chunk->count * sizeof(int));
+    int *worklist = malloc(chunk->count * sizeof(int));
+    if (chunk->count > 0 && (depths == NULL || worklist == NULL)) {
+        exit(1);
+    }
+    for (int i = 0; i < chunk->count; i++) {
+        depths[i] = -1;
+    }
+    
+    int max_depth = 0;
+    int worklist_count = 0;
+    if (chunk->count > 0) {
+        depths[0] = 0;
+        worklist[worklist_count++] = 0;
+    }
+    while (worklist_count > 0) {
+        int offset = worklist[--worklist_count];
+        int depth = depths[offset] + stackEffect(chunk, offset);
+        if (depth < 0) {
+            max_depth = -1;
+            break;
+        }
+        if (depth > max_depth) {
+            max_depth = depth;
+        }
+        
+        int successors[2];
+        int successor_count = 0;
+        uint8_t op = chunk->code[offset];
+        if (op != OP_RETURN && op != OP_JUMP) {
+            successors[successor_count++] = offset + InstructionLength(chunk, offset);
+        }
+        if (isJump(op)) {
+            successors[successor_count++] = jumpDestination(chunk, offset);
+        }
+        
+        for (int j = 0; j < successor_count; j++) {
+            int successor = successors[j];
+            if (successor >= chunk->count) {
+                continue;
+            }
+            if (depths[successor] == -1) {
+                depths[successor] = depth;
+                worklist[worklist_count++] = successor;
+            } else if (depths[successor] != depth) {
+                max_depth = -1;
+                worklist_count = 0;
+                break;
+            }
+        }
+    }
+    
+    free(depths);
+    free(worklist);
+    return max_depth;
+}
@@ -0,0 +1,24 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+// OptimizeChunk runs a peephole pass over the code of a finished chunk:
+// - Jumps to jumps go straight to the final destination.
+// - OP_NOT followed by OP_JUMP_IF_FALSE becomes OP_JUMP_IF_TRUE, when both
+//   paths pop the condition.
+// - Unreachable code and jumps to the next instruction are removed.
+// - Runs of OP_POP and OP_POPN become a single OP_POPN.
+// The line of each remaining instruction is kept. Building with NO_PEEPHOLE
+// disables the pass.
+void OptimizeChunk(Chunk *chunk);
+
+// MaxStackDepth returns the largest number of values the code of chunk keeps
+// on the stack above the ones there when it starts (the callee and its
+// arguments), following every path through the code. It returns -1 if the
+// code leaves a different number of values on the stack depending on the
+// path, which the compiler only does for code with a parse error. It doesn't allocate through the GC,
+// so it can run on functions that aren't rooted yet.
+int MaxStackDepth(Chunk *chunk);
+
+#endif
@@ -0,0 +1,42 @@
+#include <string.h>
+
+#include "output.h"
+
+void InitOutput(Output *output, FILE *file, char *chars, size_t capacity, bool line_buffered) {
+    output->file = file;
+    output->chars = chars;
+    output->count = 0;
+    output->capacity = capacity;
+    output->line_buffered = line_buffered;
+}
+
+void FlushOutput(Output *output) {
+    if (output->count > 0) {
+        fwrite(output->chars, 1, output->count, output->file);
+        output->count = 0;
+    }
+    fflush(output->file);
+}
+
+void WriteOutput(Output *output, const char *chars, size_t length) {
+    if (length > output->capacity - output->count) {
+        FlushOutput(output);
+        if (length >= output->capacity) {
+            fwrite(chars, 1, length, output->file);
+            return;
+        }
+    }
+    
+    memcpy(output->chars + output->count, chars, length);
+    output->count += length;
+    if (output->line_buffered && memchr(chars, '\n', length) != NULL) {
+        FlushOutput(output);
+    }
+}
+
+char *ReserveOutput(Output *output, size_t length) {
+    if (length > output->capacity - output->count) {
+        FlushOutput(output);
+    }
+    return output->chars + output->count;
+}
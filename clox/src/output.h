@@ -0,0 +1,40 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+
+// Size of the buffer in front of the standard output, see vm.out.
+#ifndef OUTPUT_BUFFER_SIZE
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#endif
+
+// Output buffers what is written to a file, and writes it out when the buffer
+// is full, when it's flushed, and after every newline if it's line buffered.
+// Values are formatted directly into the buffer.
+typedef struct {
+    FILE *file;
+    char *chars;
+    size_t count;
+    size_t capacity;
+    bool line_buffered;
+} Output;
+
+// InitOutput makes output buffer in chars, which holds capacity characters,
+// what is written to file.
+void InitOutput(Output *output, FILE *file, char *chars, size_t capacity, bool line_buffered);
+void FlushOutput(Output *output);
+void WriteOutput(Output *output, const char *chars, size_t length);
+
+static inline void WriteOutputString(Output *output, const char *string) {
+    WriteOutput(output, string, strlen(string));
+}
+
+// ReserveOutput returns room for length characters at the end of the buffer,
+// flushing it if needed. The caller writes them there and adds the number it
+// wrote to output->count. length must not exceed the capacity.
+char *ReserveOutput(Output *output, size_t length);
+
+#endif
@@ -2,12 +2,21 @@
 #include <string.h>
 #include <ctype.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "common.h"
 #include "scanner.h"
 
+// With SSE2, runs of whitespace, comments, strings and identifiers are
+// skipped this many characters at a time.
+#define SCAN_BLOCK 16
+
 typedef struct {
   const char *start;
   const char *current;
+  const char *end; // The '\0' ending the source
   int line;
 } Scanner;
 
@@ -16,6 +25,7 @@ Scanner scanner;
 void InitScanner(const char *source) {
     scanner.start = source;
     scanner.current = source;
+    scanner.end = source + strlen(source);
     scanner.line = 1;
 }
 
@@ -44,13 +54,89 @@ static bool isAtEnd() {
 }
 
 static bool isAlpha(char c) {
-    return c >= 'a' && c <= 'z' || c >= 'A' && c <= 'Z' || c == '_';
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
 }
 
 static bool isAlphaNum(char c) {
     return isAlpha(c) || isdigit(c);
 }
 
+// The skip functions below move the scanner ahead by whole blocks, as long
+// as there are whole blocks of the source left, and leave the rest of the run
+// to the caller, which scans it one character at a time. Without SSE2, they
+// do nothing.
+
+#ifdef __SSE2__
+static inline __m128i loadBlock() {
+    return _mm_loadu_si128((const __m128i*) scanner.current);
+}
+
+static inline uint32_t matchChar(__m128i block, char c) {
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+
+// matchRange matches the characters between low and high, both included.
+// Characters above 0x7F are negative, so they never match an ASCII range.
+static inline uint32_t matchRange(__m128i block, char low, char high) {
+    __m128i above = _mm_cmpgt_epi8(block, _mm_set1_epi8(low - 1));
+    __m128i below = _mm_cmplt_epi8(block, _mm_set1_epi8(high + 1));
+    return (uint32_t) _mm_movemask_epi8(_mm_and_si128(above, below));
+}
+#endif
+
+// skipTo moves the scanner to the next a or b.
+static void skipTo(char a, char b) {
+#ifdef __SSE2__
+    while (scanner.end - scanner.current >= SCAN_BLOCK) {
+        __m128i block = loadBlock();
+        uint32_t stops = matchChar(block, a) | matchChar(block, b);
+        if (stops != 0) {
+            scanner.current += __builtin_ctz(stops);
+            return;
+        }
+        scanner.current += SCAN_BLOCK;
+    }
+#endif
+}
+
+// skipSpaces moves the scanner past whitespace, as isspace() sees it in the
+// C locale, counting the newlines it skips.
+static void skipSpaces() {
+#ifdef __SSE2__
+    while (scanner.end - scanner.current >= SCAN_BLOCK) {
+        __m128i block = loadBlock();
+        uint32_t spaces = matchChar(block, ' ') | matchRange(block, '\t', '\r');
+        uint32_t newlines = matchChar(block, '\n');
+        if (spaces != 0xFFFF) {
+            int run = __builtin_ctz(~spaces);
+            scanner.line += __builtin_popcount(newlines & ((1u << run) - 1));
+            scanner.current += run;
+            return;
+        }
+        scanner.line += __builtin_popcount(newlines);
+        scanner.current += SCAN_BLOCK;
+    }
+#endif
+}
+
+// skipAlphaNums moves the scanner past letters, digits and underscores.
+static void skipAlphaNums() {
+#ifdef __SSE2__
+    while (scanner.end - scanner.current >= SCAN_BLOCK) {
+        __m128i block = loadBlock();
+        // Setting bit 5 maps uppercase letters to lowercase ones, and nothing
+        // else to a letter.
+        __m128i lower = _mm_or_si128(block, _mm_set1_epi8(0x20));
+        uint32_t alpha_nums = matchRange(lower, 'a', 'z') | matchRange(block, '0', '9') | matchChar(block, '_');
+        if (alpha_nums != 0xFFFF) {
+            scanner.current += __builtin_ctz(~alpha_nums);
+            return;
+        }
+        scanner.current += SCAN_BLOCK;
+    }
+#endif
+}
+
 static Token makeToken(TokenType type) {
     Token token;
     token.type = type;
@@ -71,65 +157,104 @@ static Token errorToken(const char *message) {
     return token;
 }
 
-static Token scanIdentifierOrKeyword() {
-    while (isAlphaNum(current())) {
-        scanner.current++;
+// checkKeyword returns type if the lexeme being scanned is a keyword made of
+// its first start characters followed by rest, and TOKEN_IDENTIFIER if not.
+static TokenType checkKeyword(int start, int length, const char *rest, TokenType type) {
+    if (scanner.current - scanner.start == start + length && memcmp(scanner.start + start, rest, length) == 0) {
+        return type;
     }
-    
-    char lexeme[64];
-    char *lexemep = lexeme;
-    for (const char *c = scanner.start; c != scanner.current; c++) {
-        *lexemep = *c;
-        lexemep++;
+    return TOKEN_IDENTIFIER;
+}
+
+// identifierType tells keywords from identifiers, in place: it walks a trie
+// of the keywords, spelled out as switches on their characters.
+static TokenType identifierType() {
+    int length = (int) (scanner.current - scanner.start);
+    switch (scanner.start[0]) {
+        case 'a':
+            return checkKeyword(1, 2, "nd", TOKEN_AND);
+        case 'b':
+            return checkKeyword(1, 4, "reak", TOKEN_BREAK);
+        case 'c':
+            if (length > 1) {
+                switch (scanner.start[1]) {
+                    case 'a':
+                        return checkKeyword(2, 2, "se", TOKEN_CASE);
+                    case 'l':
+                        return checkKeyword(2, 3, "ass", TOKEN_CLASS);
+                    case 'o':
+                        if (length > 3 && scanner.start[2] == 'n') {
+                            switch (scanner.start[3]) {
+                                case 's':
+                                    return checkKeyword(4, 1, "t", TOKEN_CONST);
+                                case 't':
+                                    return checkKeyword(4, 4, "inue", TOKEN_CONTINUE);
+                            }
+                        }
+                        break;
+                }
+            }
+            break;
+        case 'd':
+            return checkKeyword(1, 6, "efault", TOKEN_DEFAULT);
+        case 'e':
+            return checkKeyword(1, 3, "lse", TOKEN_ELSE);
+        case 'f':
+            if (length > 1) {
+                switch (scanner.start[1]) {
+                    case 'a':
+                        return checkKeyword(2, 3, "lse", TOKEN_FALSE);
+                    case 'o':
+                        return checkKeyword(2, 1, "r", TOKEN_FOR);
+                    case 'u':
+                        return checkKeyword(2, 1, "n", TOKEN_FUN);
+                }
+            }
+            break;
+        case 'i':
+            return checkKeyword(1, 1, "f", TOKEN_IF);
+        case 'n':
+            return checkKeyword(1, 2, "il", TOKEN_NIL);
+        case 'o':
+            return checkKeyword(1, 1, "r", TOKEN_OR);
+        case 'r':
+            return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
+        case 's':
+            if (length > 1) {
+                switch (scanner.start[1]) {
+                    case 'u':
+                        return checkKeyword(2, 3, "per", TOKEN_SUPER);
+                    case 'w':
+                        return checkKeyword(2, 4, "itch", TOKEN_SWITCH);
+                }
+            }
+            break;
+        case 't':
+            if (length > 1) {
+                switch (scanner.start[1]) {
+                    case 'h':
+                        return checkKeyword(2, 2, "is", TOKEN_THIS);
+                    case 'r':
+                        return checkKeyword(2, 2, "ue", TOKEN_TRUE);
+                }
+            }
+            break;
+        case 'v':
+            return checkKeyword(1, 2, "ar", TOKEN_VAR);
+        case 'w':
+            return checkKeyword(1, 4, "hile", TOKEN_WHILE);
     }
-    *lexemep = '\0';
     
-    TokenType type = TOKEN_IDENTIFIER;
-    if (!strcmp(lexeme, "and")) {
-        type = TOKEN_AND;
-    } else if (!strcmp(lexeme, "class")) {
-        type = TOKEN_CLASS;
-    } else if (!strcmp(lexeme, "else")) {
-        type = TOKEN_ELSE;
-    } else if (!strcmp(lexeme, "false")) {
-        type = TOKEN_FALSE;
-    } else if (!strcmp(lexeme, "for")) {
-        type = TOKEN_FOR;
-    } else if (!strcmp(lexeme, "fun")) {
-        type = TOKEN_FUN;
-    } else if (!strcmp(lexeme, "if")) {
-        type = TOKEN_IF;
-    } else if (!strcmp(lexeme, "nil")) {
-        type = TOKEN_NIL;
-    } else if (!strcmp(lexeme, "or")) {
-        type = TOKEN_OR;
-    } else if (!strcmp(lexeme, "return")) {
-        type = TOKEN_RETURN;
-    } else if (!strcmp(lexeme, "super")) {
-        type = TOKEN_SUPER;
-    } else if (!strcmp(lexeme, "this")) {
-        type = TOKEN_THIS;
-    } else if (!strcmp(lexeme, "true")) {
-        type = TOKEN_TRUE;
-    } else if (!strcmp(lexeme, "var")) {
-        type = TOKEN_VAR;
-    } else if (!strcmp(lexeme, "const")) {
-        type = TOKEN_CONST;
-    } else if (!strcmp(lexeme, "while")) {
-        type = TOKEN_WHILE;
-    } else if (!strcmp(lexeme, "switch")) {
-        type = TOKEN_SWITCH;
-    } else if (!strcmp(lexeme, "case")) {
-        type = TOKEN_CASE;
-    } else if (!strcmp(lexeme, "default")) {
-        type = TOKEN_DEFAULT;
-    } else if (!strcmp(lexeme, "continue")) {
-        type = TOKEN_CONTINUE;
-    } else if (!strcmp(lexeme, "break")) {
-        type = TOKEN_BREAK;
+    return TOKEN_IDENTIFIER;
+}
+
+static Token scanIdentifierOrKeyword() {
+    skipAlphaNums();
+    while (isAlphaNum(current())) {
+        scanner.current++;
     }
     
-    return makeToken(type);
+    return makeToken(identifierType());
 }
 
 static Token scanNumber() {
@@ -150,6 +275,7 @@ static Token scanNumber() {
 
 static Token scanString() {
     for (;;) {
+        skipTo('"', '\\');
         if (isAtEnd()) {
             break;
         }
@@ -169,6 +295,7 @@ static Token scanString() {
 }
 
 static void skipSingleLineComment() {
+    skipTo('\n', '\n');
     for (;;) {
         if (isAtEnd()) {
             return;
@@ -183,6 +310,7 @@ static void skipSingleLineComment() {
 
 static bool skipMultiLineComment() {
     for (;;) {
+        skipTo('*', '*');
         if (isAtEnd()) {
             return false;
         }
@@ -197,15 +325,14 @@ static bool skipMultiLineComment() {
 }
 
 static void skipSpace(char c) {
-    for (;;) {
-        if (c == '\n') {
+    if (c == '\n') {
+        scanner.line++;
+    }
+    skipSpaces();
+    while (isspace(current())) {
+        if (advance() == '\n') {
             scanner.line++;
         }
-        if (isspace(current())) {
-            c = advance();
-            continue;
-        }
-        return;
     }
 }
 
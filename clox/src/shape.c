@@ -0,0 +1,162 @@
+#include <stdlib.h>
+
+#include "memory.h"
+#include "object.h"
+#include "shape.h"
+
+static Shape *allocateShape(Shape *parent, ObjString **names, int count) {
+    Shape *shape = ALLOCATE(Shape, 1);
+    shape->parent = parent;
+    shape->refcount = 0;
+    shape->names = names;
+    shape->count = count;
+    shape->transitions = NULL;
+    shape->transition_count = 0;
+    shape->transition_capacity = 0;
+    
+    return shape;
+}
+
+Shape *NewShape() {
+    Shape *shape = allocateShape(NULL, NULL, 0);
+    shape->refcount = 1;
+    return shape;
+}
+
+// transitionHome returns the slot of the transitions of a shape with the given
+// capacity where the search for child starts.
+static int transitionHome(Shape *child, int capacity) {
+    return (int) (StringHash(child->names[child->count - 1]) & (capacity - 1));
+}
+
+static void insertTransition(Shape **transitions, int capacity, Shape *child) {
+    int i = transitionHome(child, capacity);
+    while (transitions[i] != NULL) {
+        i = (i + 1) & (capacity - 1);
+    }
+    transitions[i] = child;
+}
+
+// removeTransition removes child from the transitions of shape, moving back
+// the children that follow it in the same run so that no tombstone is needed.
+static void removeTransition(Shape *shape, Shape *child) {
+    Shape **transitions = shape->transitions;
+    int mask = shape->transition_capacity - 1;
+    int i = transitionHome(child, shape->transition_capacity);
+    while (transitions[i] != child) {
+        i = (i + 1) & mask;
+    }
+    
+    transitions[i] = NULL;
+    for (int j = (i + 1) & mask; transitions[j] != NULL; j = (j + 1) & mask) {
+        // transitions[j] can fill the hole at i unless its home lies
+        // (cyclically) after i, up to j.
+        int home = transitionHome(transitions[j], shape->transition_capacity);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            transitions[i] = transitions[j];
+            transitions[j] = NULL;
+            i = j;
+        }
+    }
+    shape->transition_count--;
+}
+
+static void growTransitions(Shape *shape) {
+    int capacity = GROW_CAPACITY(shape->transition_capacity);
+    Shape **transitions = ALLOCATE(Shape*, capacity);
+    for (int i = 0; i < capacity; i++) {
+        transitions[i] = NULL;
+    }
+    
+    // The allocation might have triggered a GC cycle that freed children, so
+    // the old table is only read now.
+    for (int i = 0; i < shape->transition_capacity; i++) {
+        if (shape->transitions[i] != NULL) {
+            insertTransition(transitions, capacity, shape->transitions[i]);
+        }
+    }
+    FREE_ARRAY(Shape*, shape->transitions, shape->transition_capacity);
+    
+    shape->transitions = transitions;
+    shape->transition_capacity = capacity;
+}
+
+void IncrementRefcountShape(Shape *shape) {
+    shape->refcount++;
+}
+
+void DecrementRefcountShape(Shape *shape) {
+    if (--shape->refcount > 0) {
+        return;
+    }
+    
+    // The children hold references to the shape, so it has none left.
+    Shape *parent = shape->parent;
+    if (parent != NULL) {
+        removeTransition(parent, shape);
+    }
+    FREE_ARRAY(Shape*, shape->transitions, shape->transition_capacity);
+    
+    for (int i = 0; i < shape->count; i++) {
+        DecrementRefcountObject((Obj*) shape->names[i]);
+    }
+    FREE_ARRAY(ObjString*, shape->names, shape->count);
+    
+    FREE(Shape, shape);
+    
+    if (parent != NULL) {
+        DecrementRefcountShape(parent);
+    }
+}
+
+int ShapeSlot(Shape *shape, ObjString *name) {
+    for (int i = shape->count - 1; i >= 0; i--) {
+        if (shape->names[i] == name) {
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+Shape *ShapeTransition(Shape *shape, ObjString *name) {
+    if (shape->transition_count > 0) {
+        int mask = shape->transition_capacity - 1;
+        for (int i = (int) (StringHash(name) & mask); shape->transitions[i] != NULL; i = (i + 1) & mask) {
+            Shape *child = shape->transitions[i];
+            if (child->names[child->count - 1] == name) {
+                return child;
+            }
+        }
+    }
+    
+    if (shape->count == SHAPE_MAX_FIELDS || shape->transition_count == SHAPE_MAX_TRANSITIONS) {
+        return NULL;
+    }
+    
+    ObjString **names = ALLOCATE(ObjString*, shape->count + 1);
+    for (int i = 0; i < shape->count; i++) {
+        names[i] = shape->names[i];
+        IncrementRefcountObject((Obj*) names[i]);
+    }
+    names[shape->count] = name;
+    IncrementRefcountObject((Obj*) name);
+    
+    Shape *child = allocateShape(shape, names, shape->count + 1);
+    IncrementRefcountShape(shape);
+    
+    // The table is kept at most 3/4 full.
+    if (4 * (shape->transition_count + 1) > 3 * shape->transition_capacity) {
+        growTransitions(shape);
+    }
+    insertTransition(shape->transitions, shape->transition_capacity, child);
+    shape->transition_count++;
+    
+    return child;
+}
+
+void MarkShape(Shape *shape) {
+    for (int i = 0; i < shape->count; i++) {
+        MarkObj((Obj*) shape->names[i]);
+    }
+}
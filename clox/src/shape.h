@@ -0,0 +1,66 @@
+#ifndef clox_shape_h
+#define clox_shape_h
+
+#include "common.h"
+#include "value.h"
+
+// Maximum number of fields of an instance described by a shape. Instances
+// that get more fields than this switch to dictionary mode.
+#define SHAPE_MAX_FIELDS 64
+
+// Maximum number of children of a shape. Instances that would need another
+// child switch to dictionary mode, so that fields with many different names
+// (e.g. set with setProp()) don't grow the shape tree without bounds.
+#define SHAPE_MAX_TRANSITIONS 64
+
+// A shape (or hidden class) describes the layout of the fields of an
+// instance: which fields it has and in which slot each one is stored.
+// Instances that get the same fields in the same order share the same shape.
+//
+// Shapes form a tree rooted at the empty shape. The children of a shape are
+// the shapes obtained by adding one more field to it.
+//
+// Shapes are reference counted. The instances in shape mode, the inline cache
+// entries and the children of a shape hold references to it, and it's freed
+// as soon as there are none left. The GC doesn't trace shapes: those holding
+// a shape mark its names.
+typedef struct Shape {
+    struct Shape *parent;
+    int refcount;
+    
+    // names[i] is the name of the field stored in slot i.
+    ObjString **names;
+    int count;
+    
+    // Hash table of the children, keyed by the name of their last field, with
+    // linear probing. The children aren't counted as references.
+    struct Shape **transitions;
+    int transition_count;
+    int transition_capacity; // 0 or a power of 2
+} Shape;
+
+// NewShape returns a new empty shape, the root of a shape tree, with a
+// refcount of 1.
+Shape *NewShape();
+
+void IncrementRefcountShape(Shape *shape);
+// DecrementRefcountShape frees the shape if it was the last reference to it.
+void DecrementRefcountShape(Shape *shape);
+
+// ShapeSlot returns the slot of the field with the given name, or -1 if the
+// shape doesn't have a field with that name.
+int ShapeSlot(Shape *shape, ObjString *name);
+
+// ShapeTransition returns the shape obtained by adding a field with the given
+// name to shape, creating it if needed. name must be interned.
+//
+// Returns NULL if the new shape would have more than SHAPE_MAX_FIELDS fields,
+// or would be a child too many of shape.
+Shape *ShapeTransition(Shape *shape, ObjString *name);
+
+// GC related functions
+
+// MarkShape marks the names of the fields described by the shape.
+void MarkShape(Shape *shape);
+
+#endif
@@ -0,0 +1,247 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+#ifdef __SANITIZE_ADDRESS__
+// Free slots are poisoned so that AddressSanitizer still catches uses of freed
+// objects, even though their memory stays in the page.
+#include <sanitizer/asan_interface.h>
+#define POISON(pointer, size) ASAN_POISON_MEMORY_REGION(pointer, size)
+#define UNPOISON(pointer, size) ASAN_UNPOISON_MEMORY_REGION(pointer, size)
+#else
+#define POISON(pointer, size) ((void) (pointer), (void) (size))
+#define UNPOISON(pointer, size) ((void) (pointer), (void) (size))
+#endif
+
+#define SIZE_CLASSES (SLAB_MAX_SIZE / SLAB_GRANULE)
+#define MAX_SLOTS (SLAB_PAGE_SIZE / SLAB_GRANULE)
+
+typedef struct Page {
+    struct Page *next; // Next page in pages
+    struct Page *next_young; // Next page in young_pages
+    bool in_young_pages;
+    size_t slot_size;
+    int slot_count;
+    int bump; // Slots from this index on have never been handed out
+    uint8_t *slots;
+    uint64_t used[MAX_SLOTS / 64]; // Bitmap of the slots holding an object
+} Page;
+
+// FreeSlot is what a free slot holds while it's in its class' free list.
+typedef struct FreeSlot {
+    struct FreeSlot *next;
+    int index; // Index of the slot in its page
+} FreeSlot;
+
+// LargeObj precedes objects too large for the slabs, it keeps the sweeper
+// able to find them.
+typedef struct LargeObj {
+    struct LargeObj *prev;
+    struct LargeObj *next;
+} LargeObj;
+
+static Page *pages;
+static Page *young_pages; // Pages that may hold young objects
+static Page *current_pages[SIZE_CLASSES]; // Pages that slots are bumped from
+static FreeSlot *free_slots[SIZE_CLASSES];
+static LargeObj *large_objs;
+
+static inline int sizeClass(size_t size) {
+    return (int) ((size + SLAB_GRANULE - 1) / SLAB_GRANULE) - 1;
+}
+
+// Pages are aligned on their size, so the page of a slot is found by masking
+// its address.
+static inline Page *pageOf(void *slot) {
+    return (Page*) ((uintptr_t) slot & ~((uintptr_t) SLAB_PAGE_SIZE - 1));
+}
+
+static Page *newPage(int size_class) {
+    Page *page = (Page*) aligned_alloc(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+    if (page == NULL) {
+        exit(1);
+    }
+    
+    size_t header_size = (sizeof(Page) + SLAB_GRANULE - 1) / SLAB_GRANULE * SLAB_GRANULE;
+    page->slot_size = (size_t) (size_class + 1) * SLAB_GRANULE;
+    page->slot_count = (int) ((SLAB_PAGE_SIZE - header_size) / page->slot_size);
+    page->bump = 0;
+    page->slots = (uint8_t*) page + header_size;
+    memset(page->used, 0, sizeof(page->used));
+    POISON(page->slots, SLAB_PAGE_SIZE - header_size);
+    
+    page->in_young_pages = false;
+    page->next_young = NULL;
+    page->next = pages;
+    pages = page;
+    
+    return page;
+}
+
+void InitSlabs() {
+    pages = NULL;
+    young_pages = NULL;
+    for (int i = 0; i < SIZE_CLASSES; i++) {
+        current_pages[i] = NULL;
+        free_slots[i] = NULL;
+    }
+    large_objs = NULL;
+}
+
+void FreeSlabs() {
+    while (pages != NULL) {
+        Page *next = pages->next;
+        free(pages);
+        pages = next;
+    }
+    while (large_objs != NULL) {
+        LargeObj *next = large_objs->next;
+        free(large_objs);
+        large_objs = next;
+    }
+    InitSlabs();
+}
+
+static void *allocLarge(size_t size) {
+    LargeObj *large = (LargeObj*) malloc(sizeof(LargeObj) + size);
+    if (large == NULL) {
+        exit(1);
+    }
+    
+    large->prev = NULL;
+    large->next = large_objs;
+    if (large_objs != NULL) {
+        large_objs->prev = large;
+    }
+    large_objs = large;
+    
+    return large + 1;
+}
+
+static void freeLarge(void *pointer) {
+    LargeObj *large = (LargeObj*) pointer - 1;
+    if (large->prev != NULL) {
+        large->prev->next = large->next;
+    }
+    if (large->next != NULL) {
+        large->next->prev = large->prev;
+    }
+    if (large_objs == large) {
+        large_objs = large->next;
+    }
+    free(large);
+}
+
+void *SlabAlloc(size_t size) {
+    if (size > SLAB_MAX_SIZE) {
+        return allocLarge(size);
+    }
+    
+    int size_class = sizeClass(size);
+    Page *page;
+    int index;
+    uint8_t *slot;
+    
+    FreeSlot *free_slot = free_slots[size_class];
+    if (free_slot != NULL) {
+        page = pageOf(free_slot);
+        UNPOISON(free_slot, page->slot_size);
+        free_slots[size_class] = free_slot->next;
+        index = free_slot->index;
+        slot = (uint8_t*) free_slot;
+    } else {
+        page = current_pages[size_class];
+        if (page == NULL || page->bump == page->slot_count) {
+            page = current_pages[size_class] = newPage(size_class);
+        }
+        index = page->bump++;
+        slot = page->slots + index * page->slot_size;
+        UNPOISON(slot, page->slot_size);
+    }
+    
+    page->used[index / 64] |= (uint64_t) 1 << (index % 64);
+    
+    // New objects are young.
+    if (!page->in_young_pages) {
+        page->in_young_pages = true;
+        page->next_young = young_pages;
+        young_pages = page;
+    }
+    
+    return slot;
+}
+
+void SlabFree(void *pointer, size_t size) {
+    if (size > SLAB_MAX_SIZE) {
+        freeLarge(pointer);
+        return;
+    }
+    
+    Page *page = pageOf(pointer);
+    int index = (int) (((uint8_t*) pointer - page->slots) / page->slot_size);
+    page->used[index / 64] &= ~((uint64_t) 1 << (index % 64));
+    
+    int size_class = sizeClass(page->slot_size);
+    FreeSlot *free_slot = (FreeSlot*) pointer;
+    free_slot->next = free_slots[size_class];
+    free_slot->index = index;
+    free_slots[size_class] = free_slot;
+    POISON(pointer, page->slot_size);
+}
+
+// visitPage calls visit on the objects in page and returns the number of
+// young objects left in it.
+static int visitPage(Page *page, bool young_only, void (*visit)(Obj *obj)) {
+    int young = 0;
+    for (int i = 0; i < (page->bump + 63) / 64; i++) {
+        // visit may free objects and clear their bits, but it never allocates.
+        uint64_t used = page->used[i];
+        while (used != 0) {
+            int bit = __builtin_ctzll(used);
+            used &= used - 1;
+            
+            Obj *obj = (Obj*) (page->slots + (i * 64 + bit) * page->slot_size);
+            if (young_only && obj->old) {
+                continue;
+            }
+            visit(obj);
+            if ((page->used[i] & ((uint64_t) 1 << bit)) && !obj->old) {
+                young++;
+            }
+        }
+    }
+    
+    return young;
+}
+
+void ForEachObj(bool young_only, void (*visit)(Obj *obj)) {
+    if (young_only) {
+        // Pages left without young objects leave the list.
+        Page **link = &young_pages;
+        while (*link != NULL) {
+            Page *page = *link;
+            if (visitPage(page, true, visit) == 0) {
+                page->in_young_pages = false;
+                *link = page->next_young;
+            } else {
+                link = &page->next_young;
+            }
+        }
+    } else {
+        for (Page *page = pages; page != NULL; page = page->next) {
+            visitPage(page, false, visit);
+        }
+    }
+    
+    LargeObj *large = large_objs;
+    while (large != NULL) {
+        LargeObj *next = large->next;
+        Obj *obj = (Obj*) (large + 1);
+        if (!young_only || !obj->old) {
+            visit(obj);
+        }
+        large = next;
+    }
+}
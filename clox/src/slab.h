@@ -0,0 +1,25 @@
+#ifndef clox_slab_h
+#define clox_slab_h
+
+#include "common.h"
+#include "object.h"
+
+// Objects live in pages of SLAB_PAGE_SIZE bytes, each one holding slots of a
+// single size class. Free slots of a class are kept in a free list, and pages
+// record which of their slots are in use so the sweeper can walk them.
+// Objects larger than SLAB_MAX_SIZE get their own allocation.
+#define SLAB_PAGE_SIZE (64 * 1024)
+#define SLAB_GRANULE 16
+#define SLAB_MAX_SIZE 256
+
+void InitSlabs();
+void FreeSlabs();
+
+void *SlabAlloc(size_t size);
+void SlabFree(void *pointer, size_t size);
+
+// ForEachObj calls visit on every allocated object, or only on the young ones
+// if young_only is set. visit may free the object it's given.
+void ForEachObj(bool young_only, void (*visit)(Obj *obj));
+
+#endif
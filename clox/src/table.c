@@ -2,152 +2,236 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define TOMBSTONE_VAL FromBoolean(true)
+// Control bytes of full slots hold a hash fragment, so their high bit is 0.
+#define CTRL_EMPTY ((uint8_t) 0x80)
+#define CTRL_DELETED ((uint8_t) 0xFE)
+
+// Load factor alpha = 87.5%, counting deleted slots, so that every probe
+// sequence ends on an empty slot.
+#define MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+// The keys, values and control bytes of a table share one allocation, in
+// that order so that each array stays aligned. So do the strings and control
+// bytes of a string set.
+#define SLOT_SIZE (sizeof(ObjString*) + sizeof(Value) + sizeof(uint8_t))
+#define SET_SLOT_SIZE (sizeof(ObjString*) + sizeof(uint8_t))
+
+// Deleted slots of a string set are reclaimed after a collection once they
+// are this many.
+#define MAX_DELETED(capacity) ((capacity) / 4)
 
-inline static bool isTombstone(Entry *entry) {
-    return entry->key == NULL && IsBoolean(entry->value) && entry->value.as.boolean;
+static inline bool isFull(uint8_t ctrl) {
+    return (ctrl & 0x80) == 0;
+}
+
+static inline uint8_t hashFragment(uint32_t hash) {
+    return hash & 0x7F;
+}
+
+// The rest of the hash picks the first group of the probe sequence.
+static inline size_t firstGroup(size_t capacity, uint32_t hash) {
+    return (hash >> 7) & (capacity / TABLE_GROUP_SIZE - 1);
+}
+
+// Groups are probed with triangular steps, which visit every group once when
+// their number is a power of 2.
+static inline size_t nextGroup(size_t capacity, size_t group, size_t step) {
+    return (group + step) & (capacity / TABLE_GROUP_SIZE - 1);
+}
+
+// matchByte returns a bitmask of the control bytes of group equal to byte.
+static inline uint32_t matchByte(const uint8_t *group, uint8_t byte) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i*) group);
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char) byte)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+        mask |= (uint32_t) (group[i] == byte) << i;
+    }
+    return mask;
+#endif
 }
 
-//  Assumes the table is not full and is non-empty.
-static Entry *probe(Table *table, ObjString *key) {
-    Entry *tombstone = NULL;
-    size_t i = key->hash & (table->capacity - 1);
-    for (;;) {
-        Entry *entry = &table->entries[i];
-        if (entry->key == NULL) {
-            if (!isTombstone(entry)) {
-                return tombstone ? tombstone : entry;
+// matchFree returns a bitmask of the empty or deleted slots of group.
+static inline uint32_t matchFree(const uint8_t *group) {
+#ifdef __SSE2__
+    return (uint32_t) _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+        mask |= (uint32_t) (group[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+static inline bool groupHasEmpty(const uint8_t *ctrl, size_t slot) {
+    return matchByte(ctrl + slot / TABLE_GROUP_SIZE * TABLE_GROUP_SIZE, CTRL_EMPTY) != 0;
+}
+
+// find returns the slot holding key, or -1 if it isn't in the table.
+static long find(Table *table, ObjString *key) {
+    if (table->count == 0) {
+        return -1;
+    }
+    
+    uint8_t fragment = hashFragment(key->hash);
+    size_t group = firstGroup(table->capacity, key->hash);
+    for (size_t step = 1;; step++) {
+        const uint8_t *ctrl = table->ctrl + group * TABLE_GROUP_SIZE;
+        uint32_t match = matchByte(ctrl, fragment);
+        while (match != 0) {
+            size_t slot = group * TABLE_GROUP_SIZE + __builtin_ctz(match);
+            // Keys are interned, so they can be compared by address.
+            if (table->keys[slot] == key) {
+                return (long) slot;
             }
-            tombstone = tombstone ? tombstone : entry; 
-        } else if (entry->key == key) {
-            // This is possible because we're using string interning,
-            // otherwise we would have to compare byte by byte.
-            return entry;
+            match &= match - 1;
         }
-        
-        i = (i + 1) & (table->capacity - 1);
+        if (matchByte(ctrl, CTRL_EMPTY) != 0) {
+            return -1;
+        }
+        group = nextGroup(table->capacity, group, step);
     }
 }
 
-static void grow(Table *table) {
-    if (table->capacity == 0) {
-        // GROW_ARRAY() might trigger a garbage collection, which will try (if
-        // this is the 'strings' table) try to free unmarked objects in this
-        // table. The garbage collector reads the 'capacity' field to traverse
-        // the entries in this table. Therefore, we should only update the
-        // 'capacity' field *after* the call to GROW_ARRAY().
-        size_t new_cap = GROW_CAPACITY(0);
-        table->entries = GROW_ARRAY(Entry, table->entries, 0, new_cap);
-        table->capacity = new_cap;
-        for (size_t i = 0; i < table->capacity; i++) {
-            table->entries[i].key = NULL;     
-            table->entries[i].value = FromNil();
+// findFree returns the first empty or deleted slot of the probe sequence of
+// hash in ctrl. Assumes there is one.
+static size_t findFree(const uint8_t *ctrl, size_t capacity, uint32_t hash) {
+    size_t group = firstGroup(capacity, hash);
+    for (size_t step = 1;; step++) {
+        uint32_t match = matchFree(ctrl + group * TABLE_GROUP_SIZE);
+        if (match != 0) {
+            return group * TABLE_GROUP_SIZE + __builtin_ctz(match);
         }
-        return;
+        group = nextGroup(capacity, group, step);
+    }
+}
+
+// newCapacity returns the capacity a table or a set of count entries grows
+// to. When deleted slots are what fills it, it keeps its capacity and
+// rehashing it is enough to get rid of them.
+static size_t newCapacity(size_t count, size_t capacity) {
+    if (capacity == 0) {
+        return TABLE_GROUP_SIZE;
     }
+    if (count + 1 > MAX_LOAD(capacity) / 2) {
+        return GROW_CAPACITY(capacity);
+    }
+    return capacity;
+}
+
+static void resize(Table *table, size_t new_cap) {
+    // ALLOCATE() might trigger a garbage collection, which will traverse this
+    // table (and remove keys from it, if it's the 'strings' table). The table
+    // must stay untouched until the new arrays are allocated.
+    uint8_t *block = ALLOCATE(uint8_t, new_cap * SLOT_SIZE);
     
     size_t cur_cap = table->capacity;
-    size_t new_cap = GROW_CAPACITY(cur_cap);
-    
-    Entry *cur_entries = table->entries;
-    table->entries = ALLOCATE(Entry, new_cap);
-    for (size_t i = 0; i < new_cap; i++) {
-        table->entries[i].key = NULL;     
-        table->entries[i].value = FromNil();
-    }
+    ObjString **cur_keys = table->keys;
+    Value *cur_values = table->values;
+    uint8_t *cur_ctrl = table->ctrl;
     
+    table->keys = (ObjString**) block;
+    table->values = (Value*) (block + new_cap * sizeof(ObjString*));
+    table->ctrl = block + new_cap * (sizeof(ObjString*) + sizeof(Value));
     table->capacity = new_cap;
+    table->deleted = 0;
+    memset(table->ctrl, CTRL_EMPTY, new_cap);
     
-    table->count = 0; // We recalculate count as part of the moves below
+    // Entries are moved, not reinserted: the table keeps its references, so
+    // there are no refcounts to update.
     for (size_t i = 0; i < cur_cap; i++) {
-        Entry *entry = &cur_entries[i];
-        if (entry->key == NULL) {
+        if (!isFull(cur_ctrl[i])) {
             continue;
         }
         
-        Insert(table, entry->key, entry->value);
-        
-        // Insert increments the refcounts of the key and of the value, so we have to decrement them
-        DecrementRefcountObject((Obj*) entry->key);
-        DecrementRefcountValue(entry->value);
+        size_t slot = findFree(table->ctrl, new_cap, cur_keys[i]->hash);
+        table->ctrl[slot] = cur_ctrl[i];
+        table->keys[slot] = cur_keys[i];
+        table->values[slot] = cur_values[i];
     }
     
-    FREE_ARRAY(Entry, cur_entries, cur_cap);
+    FREE_ARRAY(uint8_t, (uint8_t*) cur_keys, cur_cap * SLOT_SIZE);
 }
 
 void InitTable(Table *table) {
     table->count = 0;
+    table->deleted = 0;
     table->capacity = 0;
-    table->entries = NULL;
+    table->ctrl = NULL;
+    table->keys = NULL;
+    table->values = NULL;
 }
 
 void FreeTable(Table *table) {
     for (size_t i = 0; i < table->capacity; i++) {
-        Entry *entry = &table->entries[i];
-        if (entry->key == NULL) {
+        if (!isFull(table->ctrl[i])) {
             continue;
         }
         
-        DecrementRefcountObject((Obj*) entry->key);
-        DecrementRefcountValue(entry->value);
+        DecrementRefcountObject((Obj*) table->keys[i]);
+        DecrementRefcountValue(table->values[i]);
     }
     
-    FREE_ARRAY(Entry, table->entries, table->capacity);    
+    FREE_ARRAY(uint8_t, (uint8_t*) table->keys, table->capacity * SLOT_SIZE);
     InitTable(table);
 }
 
 bool Insert(Table *table, ObjString *key, Value value) {
-    // Load factor alpha = 75%
-    // At all times either capacity = 0 or count / capacity < 0.75.
-    if (4 * (table->count + 1) >= 3 * table->capacity) {
-        grow(table);
+    long found = find(table, key);
+    if (found >= 0) {
+        DecrementRefcountValue(table->values[found]);
+        table->values[found] = value; IncrementRefcountValue(value);
+        return false;
+    }
+    
+    if (table->count + table->deleted + 1 > MAX_LOAD(table->capacity)) {
+        resize(table, newCapacity(table->count, table->capacity));
     }
     
-    Entry *entry = probe(table, key);
-    bool new_entry = entry->key == NULL;
-    if (new_entry) {
-        IncrementRefcountObject((Obj*) key);
-        if (!isTombstone(entry)) table->count++;
-    } else {
-        DecrementRefcountValue(entry->value);
+    size_t slot = findFree(table->ctrl, table->capacity, key->hash);
+    if (table->ctrl[slot] == CTRL_DELETED) {
+        table->deleted--;
     }
-    entry->key = key;
-    entry->value = value; IncrementRefcountValue(value);
+    table->ctrl[slot] = hashFragment(key->hash);
+    table->keys[slot] = key; IncrementRefcountObject((Obj*) key);
+    table->values[slot] = value; IncrementRefcountValue(value);
+    table->count++;
     
-    return new_entry;
+    return true;
 }
 
 bool Get(Table *table, ObjString *key, Value *value) {
-    if (table->count == 0) {
-        return false;     
-    }
-    
-    Entry *entry = probe(table, key);
-    if (entry->key == NULL) {
+    long found = find(table, key);
+    if (found < 0) {
         return false;
     }
-    *value = entry->value;
+    *value = table->values[found];
     return true;
 }
 
 void Remove(Table *table, ObjString *key) {
-    if (table->count == 0) {
-        return;
-    }
-    
-    Entry *entry = probe(table, key);
-    if (entry->key == NULL) {
+    long found = find(table, key);
+    if (found < 0) {
         return;
     }
     
-    Value v = entry->value;
-    entry->key = NULL;
-    entry->value = TOMBSTONE_VAL;
+    Value v = table->values[found];
+    table->ctrl[found] = CTRL_DELETED;
+    table->keys[found] = NULL;
+    table->count--;
+    table->deleted++;
     
     DecrementRefcountObject((Obj*) key);
     DecrementRefcountValue(v);
@@ -155,54 +239,179 @@ void Remove(Table *table, ObjString *key) {
 
 void CopyTable(Table *src, Table *dst) {
     for (size_t i = 0; i < src->capacity; i++) {
-        Entry *entry = &src->entries[i];
-        if (entry->key == NULL) {
+        if (!isFull(src->ctrl[i])) {
             continue;
         }
         
-        Insert(dst, entry->key, entry->value);
+        Insert(dst, src->keys[i], src->values[i]);
     }
 }
 
-ObjString *Intern(Table *table, ObjString *key) {
-    if (table->capacity == 0) {
-        return NULL;
+void MarkTable(Table *table) {
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (!isFull(table->ctrl[i])) {
+            continue;
+        }
+        
+        MarkObj((Obj*) table->keys[i]);
+        MarkValue(table->values[i]);
     }
-    
-    size_t i = key->hash & (table->capacity - 1);    
-    for (;;) {
-        Entry *entry = &table->entries[i];
-        if (entry->key == NULL && !isTombstone(entry)) {
-            return NULL;
+}
+
+void InitStringSet(StringSet *set) {
+    set->count = 0;
+    set->deleted = 0;
+    set->capacity = 0;
+    set->ctrl = NULL;
+    set->strings = NULL;
+}
+
+void FreeStringSet(StringSet *set) {
+    for (size_t i = 0; i < set->capacity; i++) {
+        if (isFull(set->ctrl[i])) {
+            DecrementRefcountObject((Obj*) set->strings[i]);
         }
-        if (entry->key != NULL &&
-            entry->key->hash == key->hash &&
-            entry->key->length == key->length &&
-            memcmp(entry->key->chars, key->chars, key->length) == 0) {
-            return entry->key; 
+    }
+    
+    FREE_ARRAY(uint8_t, (uint8_t*) set->strings, set->capacity * SET_SLOT_SIZE);
+    InitStringSet(set);
+}
+
+static void resizeStringSet(StringSet *set, size_t new_cap) {
+    // As in resize(), a GC cycle triggered by ALLOCATE() will sweep the set,
+    // so it's only changed afterwards.
+    uint8_t *block = ALLOCATE(uint8_t, new_cap * SET_SLOT_SIZE);
+    
+    size_t cur_cap = set->capacity;
+    ObjString **cur_strings = set->strings;
+    uint8_t *cur_ctrl = set->ctrl;
+    
+    set->strings = (ObjString**) block;
+    set->ctrl = block + new_cap * sizeof(ObjString*);
+    set->capacity = new_cap;
+    set->deleted = 0;
+    memset(set->ctrl, CTRL_EMPTY, new_cap);
+    
+    for (size_t i = 0; i < cur_cap; i++) {
+        if (!isFull(cur_ctrl[i])) {
+            continue;
         }
-        i = (i + 1) & (table->capacity - 1);
+        
+        size_t slot = findFree(set->ctrl, new_cap, cur_strings[i]->hash);
+        set->ctrl[slot] = cur_ctrl[i];
+        set->strings[slot] = cur_strings[i];
     }
+    
+    FREE_ARRAY(uint8_t, (uint8_t*) cur_strings, cur_cap * SET_SLOT_SIZE);
 }
 
-void MarkTable(Table *table) {
-    for (size_t i = 0; i < table->capacity; i++) {
-        Entry *entry = &table->entries[i];
-        if (entry->key == NULL) {
+// rehashInPlace gets rid of the deleted slots of set. Unlike
+// resizeStringSet(), it doesn't allocate, so it can run during a GC cycle.
+static void rehashInPlace(StringSet *set) {
+    uint8_t *ctrl = set->ctrl;
+    
+    // Deleted slots become empty, and full ones are marked deleted until
+    // their string is placed again.
+    for (size_t i = 0; i < set->capacity; i++) {
+        ctrl[i] = isFull(ctrl[i]) ? CTRL_DELETED : CTRL_EMPTY;
+    }
+    
+    size_t i = 0;
+    while (i < set->capacity) {
+        if (ctrl[i] != CTRL_DELETED) {
+            i++;
             continue;
         }
         
-        MarkObj((Obj*) entry->key);
-        MarkValue(entry->value);
+        ObjString *string = set->strings[i];
+        size_t slot = findFree(ctrl, set->capacity, string->hash);
+        if (slot / TABLE_GROUP_SIZE == i / TABLE_GROUP_SIZE) {
+            // The string already is in the first group with room for it.
+            ctrl[i] = hashFragment(string->hash);
+            i++;
+        } else if (ctrl[slot] == CTRL_EMPTY) {
+            ctrl[slot] = hashFragment(string->hash);
+            set->strings[slot] = string;
+            ctrl[i] = CTRL_EMPTY;
+            set->strings[i] = NULL;
+            i++;
+        } else {
+            // The slot holds a string that isn't placed yet, which is placed
+            // next from slot i.
+            ctrl[slot] = hashFragment(string->hash);
+            set->strings[i] = set->strings[slot];
+            set->strings[slot] = string;
+        }
     }
+    
+    set->deleted = 0;
 }
 
-void RemoveUnmarkedKeys(Table *table) {
-    for (size_t i = 0; i < table->capacity; i++) {
-        Entry *entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.marked) {
-            entry->key = NULL;
-            entry->value = TOMBSTONE_VAL;
+void AddString(StringSet *set, ObjString *string) {
+    if (set->count + set->deleted + 1 > MAX_LOAD(set->capacity)) {
+        resizeStringSet(set, newCapacity(set->count, set->capacity));
+    }
+    
+    size_t slot = findFree(set->ctrl, set->capacity, string->hash);
+    if (set->ctrl[slot] == CTRL_DELETED) {
+        set->deleted--;
+    }
+    set->ctrl[slot] = hashFragment(string->hash);
+    set->strings[slot] = string; IncrementRefcountObject((Obj*) string);
+    set->count++;
+}
+
+ObjString *FindString(StringSet *set, ObjString *string) {
+    if (set->count == 0) {
+        return NULL;
+    }
+    
+    uint8_t fragment = hashFragment(string->hash);
+    size_t group = firstGroup(set->capacity, string->hash);
+    for (size_t step = 1;; step++) {
+        const uint8_t *ctrl = set->ctrl + group * TABLE_GROUP_SIZE;
+        uint32_t match = matchByte(ctrl, fragment);
+        while (match != 0) {
+            ObjString *candidate = set->strings[group * TABLE_GROUP_SIZE + __builtin_ctz(match)];
+            if (candidate->hash == string->hash &&
+                candidate->length == string->length &&
+                memcmp(candidate->chars, string->chars, string->length) == 0) {
+                return candidate;
+            }
+            match &= match - 1;
+        }
+        if (matchByte(ctrl, CTRL_EMPTY) != 0) {
+            return NULL;
+        }
+        group = nextGroup(set->capacity, group, step);
+    }
+}
+
+void SweepStringSet(StringSet *set, bool young_only) {
+    for (size_t i = 0; i < set->capacity; i++) {
+        if (!isFull(set->ctrl[i])) {
+            continue;
+        }
+        
+        ObjString *string = set->strings[i];
+        if ((young_only && string->obj.old) || string->obj.marked) {
+            continue;
+        }
+        
+        // A group with an empty slot has never been full since the set was
+        // last rehashed, so no probe sequence goes past it: the slot can be
+        // made empty rather than deleted.
+        if (groupHasEmpty(set->ctrl, i)) {
+            set->ctrl[i] = CTRL_EMPTY;
+        } else {
+            set->ctrl[i] = CTRL_DELETED;
+            set->deleted++;
         }
+        set->strings[i] = NULL;
+        set->count--;
     }
-}
\ No newline at end of file
+    
+    if (set->deleted > MAX_DELETED(set->capacity)) {
+        rehashInPlace(set);
+    }
+}
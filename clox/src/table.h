@@ -4,15 +4,20 @@
 #include "common.h"
 #include "value.h"
 
-typedef struct {
-  ObjString* key;
-  Value value;
-} Entry;
+// Table is an open addressing hash table in the style of SwissTable. Slots
+// are probed in groups of TABLE_GROUP_SIZE, and each slot has a control byte:
+// either empty, deleted, or the low 7 bits of its key's hash. A whole group
+// is matched against a hash fragment at once (with SSE2 when available), so
+// keys are only read for slots that most likely hold the one looked up.
+#define TABLE_GROUP_SIZE 16
 
 typedef struct {
-  size_t count;
-  size_t capacity; // Always a power of 2
-  Entry* entries;
+  size_t count; // Number of keys in the table
+  size_t deleted; // Number of deleted control bytes
+  size_t capacity; // 0 or a power of 2, at least TABLE_GROUP_SIZE
+  uint8_t* ctrl;
+  ObjString** keys;
+  Value* values;
 } Table;
 
 void InitTable(Table *table);
@@ -37,11 +42,35 @@ void Remove(Table *table, ObjString *key);
 // Copy copies the src table into the dst table.
 void CopyTable(Table *src, Table *dst);
 
-// Returns the string interned in the table if it exists, NULL otherwise.
-ObjString *Intern(Table *table, ObjString *key);
-
 // GC related functions
 void MarkTable(Table *table);
-void RemoveUnmarkedKeys(Table *table);
 
-#endif
\ No newline at end of file
+// StringSet is the set of interned strings. It uses the same control bytes
+// as Table but only stores keys. Its references are weak: the GC removes the
+// strings it didn't mark, and the deleted slots they leave are reclaimed once
+// they make up a large part of the set.
+typedef struct {
+  size_t count; // Number of strings in the set
+  size_t deleted; // Number of deleted control bytes
+  size_t capacity; // 0 or a power of 2, at least TABLE_GROUP_SIZE
+  uint8_t* ctrl;
+  ObjString** strings;
+} StringSet;
+
+void InitStringSet(StringSet *set);
+void FreeStringSet(StringSet *set);
+
+// AddString adds a string that isn't in the set yet. Its hash must have
+// been computed. It may trigger a GC cycle.
+void AddString(StringSet *set, ObjString *string);
+
+// FindString returns the string of the set with the same characters as
+// string, or NULL if there's none. The hash of string must have been
+// computed.
+ObjString *FindString(StringSet *set, ObjString *string);
+
+// SweepStringSet removes the strings the GC didn't mark. With young_only,
+// strings in the old generation are kept: minor collections don't mark them.
+void SweepStringSet(StringSet *set, bool young_only);
+
+#endif
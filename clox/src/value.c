@@ -3,30 +3,43 @@
 
 #include "value.h"
 #include "memory.h"
+#include "number.h"
 
 bool ObjsEqual(const Obj *a, const Obj *b);
-void PrintObj(const Obj *obj);
+void WriteObj(Output *output, const Obj *obj);
 
 bool ValuesEqual(Value a, Value b) {
     return
-        IsBoolean(a) && IsBoolean(b) && a.as.boolean == b.as.boolean ||
-        IsNil(a) && IsNil(b) ||
-        IsNumber(a) && IsNumber(b) && a.as.number == b.as.number ||
-        IsObj(a) && IsObj(b) && ObjsEqual(a.as.obj, b.as.obj);
+        (IsBoolean(a) && IsBoolean(b) && AsBoolean(a) == AsBoolean(b)) ||
+        (IsNil(a) && IsNil(b)) ||
+        (IsNumber(a) && IsNumber(b) && AsNumber(a) == AsNumber(b)) ||
+        (IsObj(a) && IsObj(b) && ObjsEqual(AsObj(a), AsObj(b)));
 }
 
-void PrintValue(Value value) {
+// Numbers are formatted in place, in room reserved in the output buffer.
+_Static_assert(OUTPUT_BUFFER_SIZE >= NUMBER_BUFFER_SIZE, "OUTPUT_BUFFER_SIZE must fit a formatted number");
+
+void WriteValue(Output *output, Value value) {
     if (IsBoolean(value)) {
-        printf("%s", value.as.boolean ? "true" : "false");
+        WriteOutputString(output, AsBoolean(value) ? "true" : "false");
     } else if (IsNil(value)) {
-        printf("nil");
+        WriteOutputString(output, "nil");
     } else if (IsNumber(value)) {
-        printf("%g", value.as.number);
+        char *buffer = ReserveOutput(output, NUMBER_BUFFER_SIZE);
+        output->count += FormatNumber(AsNumber(value), buffer);
     } else {
-        PrintObj(value.as.obj);
+        WriteObj(output, AsObj(value));
     }
 }
 
+void PrintValue(Value value) {
+    char buffer[256];
+    Output output;
+    InitOutput(&output, stdout, buffer, sizeof(buffer), false);
+    WriteValue(&output, value);
+    FlushOutput(&output);
+}
+
 void InitValueArray(ValueArray *array) {
     array->count = 0;
     array->capacity = 0;
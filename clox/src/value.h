@@ -1,11 +1,31 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <string.h>
+
 #include "common.h"
+#include "output.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+// With NAN_BOXING, a Value is packed in 64 bits. Numbers are stored as plain
+// doubles. Every other value is a quiet NaN, which no arithmetic operation
+// produces: nil, false and true set the low bits to a tag, objects set the
+// sign bit and store the pointer in the low 48 bits.
+typedef uint64_t Value;
+
+#define SIGN_BIT ((uint64_t) 0x8000000000000000)
+#define QNAN ((uint64_t) 0x7ffc000000000000)
+
+#define TAG_NIL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+
+#else
+
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
@@ -22,6 +42,8 @@ typedef struct {
     } as;
 } Value;
 
+#endif
+
 typedef struct {
     Value value; // Undefined behaviour if error == true
     bool error;
@@ -31,12 +53,18 @@ static inline Value FromBoolean(bool boolean);
 static inline Value FromDouble(double number);
 static inline Value FromNil();
 static inline Value FromObj(Obj *obj);
+static inline bool AsBoolean(Value value);
+static inline double AsNumber(Value value);
+static inline Obj *AsObj(Value value);
 static inline bool IsBoolean(Value value);
 static inline bool IsNumber(Value value);
 static inline bool IsNil(Value value);
 static inline bool IsObj(Value value);
 static inline bool IsTruthy(Value value);
 bool ValuesEqual(Value a, Value b);
+// WriteValue formats value into output.
+void WriteValue(Output *output, Value value);
+// PrintValue writes value directly to the standard output, bypassing vm.out.
 void PrintValue(Value value);
 
 typedef struct {
@@ -51,6 +79,58 @@ void FreeValueArray(ValueArray *array);
 
 void MarkValueArray(ValueArray *array);
 
+#ifdef NAN_BOXING
+
+static inline Value FromBoolean(bool boolean) {
+    return QNAN | (boolean ? TAG_TRUE : TAG_FALSE);
+}
+
+static inline Value FromDouble(double number) {
+    Value value;
+    memcpy(&value, &number, sizeof(double));
+    return value;
+}
+
+static inline Value FromNil() {
+    return QNAN | TAG_NIL;
+}
+
+static inline Value FromObj(Obj *obj) {
+    return SIGN_BIT | QNAN | (uint64_t) (uintptr_t) obj;
+}
+
+static inline bool AsBoolean(Value value) {
+    return value == (QNAN | TAG_TRUE);
+}
+
+static inline double AsNumber(Value value) {
+    double number;
+    memcpy(&number, &value, sizeof(double));
+    return number;
+}
+
+static inline Obj *AsObj(Value value) {
+    return (Obj*) (uintptr_t) (value & ~(SIGN_BIT | QNAN));
+}
+
+static inline bool IsBoolean(Value value) {
+    return (value | 1) == (QNAN | TAG_TRUE);
+}
+
+static inline bool IsNumber(Value value) {
+    return (value & QNAN) != QNAN;
+}
+
+static inline bool IsNil(Value value) {
+    return value == (QNAN | TAG_NIL);
+}
+
+static inline bool IsObj(Value value) {
+    return (value & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT);
+}
+
+#else
+
 static inline Value FromBoolean(bool boolean) {
     return (Value) {
         .type = VAL_BOOL,
@@ -78,6 +158,18 @@ static inline Value FromObj(Obj *obj) {
     };
 }
 
+static inline bool AsBoolean(Value value) {
+    return value.as.boolean;
+}
+
+static inline double AsNumber(Value value) {
+    return value.as.number;
+}
+
+static inline Obj *AsObj(Value value) {
+    return value.as.obj;
+}
+
 static inline bool IsBoolean(Value value) {
     return value.type == VAL_BOOL;
 }
@@ -94,8 +186,10 @@ static inline bool IsObj(Value value) {
     return value.type == VAL_OBJ;
 }
 
+#endif
+
 static inline bool IsTruthy(Value value) {
-    return !(IsNil(value) || IsBoolean(value) && !value.as.boolean);
+    return !(IsNil(value) || (IsBoolean(value) && !AsBoolean(value)));
 }
 
 #endif
\ No newline at end of file
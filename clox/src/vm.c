@@ -1,40 +1,101 @@
+#include <assert.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "bytecode.h"
 #include "compiler.h"
 #include "common.h"
 #include "debug.h"
 #include "memory.h"
+#include "slab.h"
 #include "value.h"
 #include "vm.h"
 
 #define FIRST_GC 1024 * 1024
+#define FIRST_RECONCILE 1024
+#define FRAMES_MIN 16 // Initial capacity of vm.frames
+#define STACK_MIN 256 // Initial capacity of vm.stack
+
+// Values pushed above the deepest point of the code of a function while one of
+// its instructions runs, by natives and by the VM to root objects for the GC.
+#define STACK_SLACK 16
+
+// Stack traces only show the innermost calls.
+#define STACKTRACE_FRAMES 64
+
+// Threaded dispatch relies on the "labels as values" GNU extension. The
+// instruction trace printed with DEBUG needs a single dispatch point, so it
+// uses the portable switch. Define NO_COMPUTED_GOTO to force the switch.
+#if defined(__GNUC__) && !defined(DEBUG) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
 
 #define PUSH_OBJ(value) Push(FromObj((Obj*) (value)))
 
-#define AS_STRING(value) ((ObjString*) (value).as.obj)
-#define AS_FUNCTION(value) ((ObjFunction*) (value).as.obj)
-#define AS_CLOSURE(value) ((ObjClosure*) (value).as.obj)
-#define AS_NATIVE(value) ((ObjNative*) (value).as.obj)
-#define AS_CLASS(value) ((ObjClass*) (value).as.obj)
-#define AS_INSTANCE(value) ((ObjInstance*) (value).as.obj)
-#define AS_BOUND_METHOD(value) ((ObjBoundMethod*) (value).as.obj)
+#define AS_STRING(value) ((ObjString*) AsObj(value))
+#define AS_FUNCTION(value) ((ObjFunction*) AsObj(value))
+#define AS_CLOSURE(value) ((ObjClosure*) AsObj(value))
+#define AS_NATIVE(value) ((ObjNative*) AsObj(value))
+#define AS_CLASS(value) ((ObjClass*) AsObj(value))
+#define AS_INSTANCE(value) ((ObjInstance*) AsObj(value))
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod*) AsObj(value))
 
 VM vm; 
 
+// growStack moves the stack to an allocation with room for count more values
+// above stack_top, and moves the frames and the open upvalues along.
+static void growStack(int count) {
+    size_t used = vm.stack_top - vm.stack;
+    size_t capacity = vm.stack_end - vm.stack;
+    while (capacity < used + count) {
+        capacity = GROW_CAPACITY(capacity);
+    }
+    
+    Value *stack = malloc(capacity * sizeof(Value));
+    if (stack == NULL) {
+        fprintf(stderr, "Could not grow the stack\n");
+        exit(1);
+    }
+    memcpy(stack, vm.stack, used * sizeof(Value));
+    for (int i = 0; i < vm.frame_count; i++) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    for (ObjUpvalue *upvalue = vm.open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm.stack);
+    }
+    free(vm.stack);
+    
+    vm.stack = stack;
+    vm.stack_top = stack + used;
+    vm.stack_end = stack + capacity;
+}
+
+// reserveStack makes room for count more values above stack_top. Calls
+// reserve the stack size of the callee, so the instructions of the
+// interpreter loop push without checking, and pointers into the stack only
+// move during calls.
+static inline void reserveStack(int count) {
+    if (vm.stack_end - vm.stack_top < count) {
+        growStack(count);
+    }
+}
+
+// Stack slots don't hold counted references (see ReconcileRefcounts()), so
+// Push() and Pop() don't touch refcounts. Push() grows the stack for the
+// compiler and the bytecode loader, whose depth isn't known in advance.
 void Push(Value value) {
+    reserveStack(1);
     *vm.stack_top = value;
     vm.stack_top++;
-    IncrementRefcountValue(value);
 }
 
 Value Pop() {
     vm.stack_top--;
-    Value value = *vm.stack_top;
-    DecrementRefcountValue(value);
-    return value;
+    return *vm.stack_top;
 }
 
 // Beginning of declaration of native functions
@@ -55,14 +116,14 @@ ValueOpt Clock(int argc, Value *argv) {
 
 ValueOpt Sqrt(int argc, Value *argv) {
     Value arg = argv[0];
-    if (!IsNumber(arg) || arg.as.number < 0) {
+    if (!IsNumber(arg) || AsNumber(arg) < 0) {
         return (ValueOpt) {
             .error = true
         };
     }
     
     return (ValueOpt) {
-        .value = FromDouble(sqrt(arg.as.number)),
+        .value = FromDouble(sqrt(AsNumber(arg))),
         .error = false
     };
 }
@@ -75,14 +136,22 @@ ValueOpt Len(int argc, Value *argv) {
         };
     }
     return (ValueOpt) {
-        .value = FromDouble(((ObjString*) arg.as.obj)->length),
+        .value = FromDouble(StringLength(AsObj(arg))),
         .error = false
     };
 }
 
 ValueOpt Print(int argc, Value *argv) {
-    PrintValue(argv[0]);
-    printf("\n");
+    WriteValue(&vm.out, argv[0]);
+    WriteOutput(&vm.out, "\n", 1);
+    return (ValueOpt) {
+        .value = FromNil(),
+        .error = false
+    };
+}
+
+ValueOpt Flush(int argc, Value *argv) {
+    FlushOutput(&vm.out);
     return (ValueOpt) {
         .value = FromNil(),
         .error = false
@@ -96,12 +165,12 @@ ValueOpt HasProp(int argc, Value *argv) {
         };
     }
     
-    ObjInstance *instance = (ObjInstance*) argv[0].as.obj;
-    ObjString *property = (ObjString*) argv[1].as.obj;
+    ObjInstance *instance = (ObjInstance*) AsObj(argv[0]);
+    ObjString *property = InternString(Flatten(AsObj(argv[1])));
     
     Value v;
     return (ValueOpt) {
-        .value = FromBoolean(Get(&instance->fields, property, &v)),
+        .value = FromBoolean(GetField(instance, property, &v)),
         .error = false
     };
 }
@@ -113,11 +182,11 @@ ValueOpt SetProp(int argc, Value *argv) {
         };
     }
     
-    ObjInstance *instance = (ObjInstance*) argv[0].as.obj;
-    ObjString *property = (ObjString*) argv[1].as.obj;
+    ObjInstance *instance = (ObjInstance*) AsObj(argv[0]);
+    ObjString *property = InternString(Flatten(AsObj(argv[1])));
     Value value = argv[2];
     
-    Insert(&instance->fields, property, value);
+    SetField(instance, property, value);
     
     return (ValueOpt) {
         .value = FromNil(),
@@ -132,11 +201,11 @@ ValueOpt GetProp(int argc, Value *argv) {
         };
     }
     
-    ObjInstance *instance = (ObjInstance*) argv[0].as.obj;
-    ObjString *property = (ObjString*) argv[1].as.obj;
+    ObjInstance *instance = (ObjInstance*) AsObj(argv[0]);
+    ObjString *property = InternString(Flatten(AsObj(argv[1])));
     
     Value value;
-    if (Get(&instance->fields, property, &value)) {
+    if (GetField(instance, property, &value)) {
         return (ValueOpt) {
             .value = value,
             .error = false
@@ -155,10 +224,10 @@ ValueOpt DelProp(int argc, Value *argv) {
         };
     }
     
-    ObjInstance *instance = (ObjInstance*) argv[0].as.obj;
-    ObjString *property = (ObjString*) argv[1].as.obj;
+    ObjInstance *instance = (ObjInstance*) AsObj(argv[0]);
+    ObjString *property = InternString(Flatten(AsObj(argv[1])));
     
-    Remove(&instance->fields, property);
+    RemoveField(instance, property);
     
     return (ValueOpt) {
         .value = FromNil(),
@@ -166,89 +235,207 @@ ValueOpt DelProp(int argc, Value *argv) {
     };
 }
 
+int GlobalSlot(ObjString *name) {
+    Value slot;
+    if (Get(&vm.global_slots, name, &slot)) {
+        return (int) AsNumber(slot);
+    }
+    
+    PUSH_OBJ(name); // Growing the globals might trigger a GC cycle
+    if (vm.global_count == vm.global_capacity) {
+        int capacity = GROW_CAPACITY(vm.global_capacity);
+        vm.globals = GROW_ARRAY(GlobalVar, vm.globals, vm.global_capacity, capacity);
+        vm.global_capacity = capacity;
+    }
+    
+    int index = vm.global_count++;
+    GlobalVar *global = &vm.globals[index];
+    global->name = name; IncrementRefcountObject((Obj*) name);
+    global->value = FromNil();
+    global->defined = false;
+    global->is_const = false;
+    Insert(&vm.global_slots, name, FromDouble(index));
+    Pop();
+    
+    return index;
+}
+
+static void defineGlobal(ObjString *name, Value value) {
+    int slot = GlobalSlot(name);
+    GlobalVar *global = &vm.globals[slot];
+    global->value = value; IncrementRefcountValue(value);
+    global->defined = true;
+}
+
 static void defineNatives() {
     ObjString *name_obj = (ObjString*) FromString("rand", 4); PUSH_OBJ(name_obj);
     Value value = FromObj((Obj*) NewNative(Rand, 0)); Push(value);
-    Insert(&vm.globals, name_obj, value); Pop(); Pop();
+    defineGlobal(name_obj, value); Pop(); Pop();
     
     name_obj = (ObjString*) FromString("clock", 5); PUSH_OBJ(name_obj);
     value = FromObj((Obj*) NewNative(Clock, 0)); Push(value);
-    Insert(&vm.globals, name_obj, value); Pop(); Pop();
+    defineGlobal(name_obj, value); Pop(); Pop();
     
     name_obj = (ObjString*) FromString("sqrt", 4); PUSH_OBJ(name_obj);
     value = FromObj((Obj*) NewNative(Sqrt, 1)); Push(value);
-    Insert(&vm.globals, name_obj, value); Pop(); Pop();
+    defineGlobal(name_obj, value); Pop(); Pop();
     
     name_obj = (ObjString*) FromString("len", 3); PUSH_OBJ(name_obj);
     value = FromObj((Obj*) NewNative(Len, 1)); Push(value);
-    Insert(&vm.globals, name_obj, value); Pop(); Pop();
+    defineGlobal(name_obj, value); Pop(); Pop();
     
     name_obj = (ObjString*) FromString("print", 5); PUSH_OBJ(name_obj);
     value = FromObj((Obj*) NewNative(Print, 1)); Push(value);
-    Insert(&vm.globals, name_obj, value); Pop(); Pop();
+    defineGlobal(name_obj, value); Pop(); Pop();
+    
+    name_obj = (ObjString*) FromString("flush", 5); PUSH_OBJ(name_obj);
+    value = FromObj((Obj*) NewNative(Flush, 0)); Push(value);
+    defineGlobal(name_obj, value); Pop(); Pop();
     
     name_obj = (ObjString*) FromString("hasProp", 7); PUSH_OBJ(name_obj);
     value = FromObj((Obj*) NewNative(HasProp, 2)); Push(value);
-    Insert(&vm.globals, name_obj, value); Pop(); Pop();
+    defineGlobal(name_obj, value); Pop(); Pop();
     
     name_obj = (ObjString*) FromString("setProp", 7); PUSH_OBJ(name_obj);
     value = FromObj((Obj*) NewNative(SetProp, 3)); Push(value);
-    Insert(&vm.globals, name_obj, value); Pop(); Pop();
+    defineGlobal(name_obj, value); Pop(); Pop();
     
     name_obj = (ObjString*) FromString("getProp", 7); PUSH_OBJ(name_obj);
     value = FromObj((Obj*) NewNative(GetProp, 2)); Push(value);
-    Insert(&vm.globals, name_obj, value); Pop(); Pop();
+    defineGlobal(name_obj, value); Pop(); Pop();
     
     name_obj = (ObjString*) FromString("delProp", 7); PUSH_OBJ(name_obj);
     value = FromObj((Obj*) NewNative(DelProp, 2)); Push(value);
-    Insert(&vm.globals, name_obj, value); Pop(); Pop();
+    defineGlobal(name_obj, value); Pop(); Pop();
 }
 
 // End of declaration of native functions
 
 void InitVM() {
+    vm.frames = malloc(FRAMES_MIN * sizeof(CallFrame));
     vm.frame_count = 0;
+    vm.frame_capacity = FRAMES_MIN;
     
+    vm.stack = malloc(STACK_MIN * sizeof(Value));
     vm.stack_top = vm.stack;
+    vm.stack_end = vm.stack + STACK_MIN;
+    if (vm.frames == NULL || vm.stack == NULL) {
+        fprintf(stderr, "Could not allocate the stack\n");
+        exit(1);
+    }
     
-    InitTable(&vm.strings);
-    InitTable(&vm.globals);
+    InitStringSet(&vm.strings);
+    InitTable(&vm.global_slots);
+    vm.globals = NULL;
+    vm.global_count = 0;
+    vm.global_capacity = 0;
     
     vm.open_upvalues = NULL;
+    vm.root_shape = NULL;
+    
+    vm.image = NULL;
+    vm.image_size = 0;
+    vm.image_slots = NULL;
+    vm.image_slot_count = 0;
+    
+    char *out_chars = malloc(OUTPUT_BUFFER_SIZE);
+    if (out_chars == NULL) {
+        fprintf(stderr, "Could not allocate the output buffer\n");
+        exit(1);
+    }
+    InitOutput(&vm.out, stdout, out_chars, OUTPUT_BUFFER_SIZE, isatty(fileno(stdout)));
+    
+    vm.zct = NULL;
+    vm.zct_count = 0;
+    vm.zct_capacity = 0;
+    vm.next_reconcile = FIRST_RECONCILE;
     
+    vm.gc_phase = GC_IDLE;
+    vm.next_gc_slice = 0;
     vm.bytes_allocated = 0;
     vm.next_gc = FIRST_GC;
-    vm.objects = NULL;
+    InitSlabs();
+    vm.young_bytes = 0;
+    vm.remembered = NULL;
+    vm.remembered_count = 0;
+    vm.remembered_capacity = 0;
+    vm.collecting_young = false;
+    vm.gc_pause_count = 0;
+    vm.gc_pause_total = 0;
+    vm.gc_pause_max = 0;
+    vm.gc_slices_over_budget = 0;
+    vm.gc_slice_max = 0;
+    vm.gc_sweep_max = 0;
     vm.grey_objects = NULL;
     vm.grey_count = 0;
     vm.grey_capacity = 0;
     
+    vm.root_shape = NewShape();
+    
     vm.init_string = NULL;
     vm.init_string = (ObjString*) FromString("init", 4);
     defineNatives();
 }
 
 void FreeVM() {
+    #ifdef DEBUG_LOG_GC_PAUSES
+        fprintf(stderr, "gc: %d pauses, %.0f us total, %.0f us max, sweeps up to %.0f us\n",
+            vm.gc_pause_count, vm.gc_pause_total, vm.gc_pause_max, vm.gc_sweep_max);
+        fprintf(stderr, "gc: marking slices up to %.0f us, %d over the %d us budget\n",
+            vm.gc_slice_max, vm.gc_slices_over_budget, GC_PAUSE_BUDGET_US);
+    #endif
+    
+    // Every object is freed, so all of them are released first: nothing
+    // decrements the refcount of an object that is already freed.
+    #ifdef DEBUG_LOG_GC
+        printf("Releasing objects.\n");
+    #endif
+    ForEachObj(false, ReleaseObj);
+    while (vm.remembered_count > 0) {
+        vm.remembered[--vm.remembered_count]->remembered_index = -1;
+    }
+    
+    #ifdef DEBUG_LOG_GC
+        printf("Freeing globals.\n");
+    #endif
+    FreeTable(&vm.global_slots);
+    for (int i = 0; i < vm.global_count; i++) {
+        DecrementRefcountObject((Obj*) vm.globals[i].name);
+        DecrementRefcountValue(vm.globals[i].value);
+    }
+    FREE_ARRAY(GlobalVar, vm.globals, vm.global_capacity);
+    vm.globals = NULL;
+    vm.global_count = 0;
+    vm.global_capacity = 0;
+    
     #ifdef DEBUG_LOG_GC
-        printf("Freeing globals table.\n");
+        printf("Freeing shapes.\n");
     #endif
-    FreeTable(&vm.globals);
+    // The objects released above held all the references to the other shapes.
+    DecrementRefcountShape(vm.root_shape);
+    vm.root_shape = NULL;
     
     #ifdef DEBUG_LOG_GC
         printf("Freeing string table.\n");
     #endif
-    FreeTable(&vm.strings);
+    FreeStringSet(&vm.strings);
     
     vm.init_string = NULL;
     
     #ifdef DEBUG_LOG_GC
-        printf("Freeing remaining objects.\n");
+        printf("Freeing objects.\n");
     #endif
-    while (vm.objects != NULL) {
-        FreeObj(vm.objects);
-    }
+    ForEachObj(false, FreeReleasedObj);
+    FreeSlabs();
+    FreeBytecodeImage();
     
     free(vm.grey_objects);
+    free(vm.remembered);
+    free(vm.zct);
+    free(vm.frames);
+    free(vm.stack);
+    FlushOutput(&vm.out);
+    free(vm.out.chars);
 }
 
 static Value peek(int index) {
@@ -256,10 +443,12 @@ static Value peek(int index) {
 }
 
 static void runtimeError(const char *message) {
+    FlushOutput(&vm.out);
     fprintf(stderr, message);
     
     fprintf(stderr, "\nStacktrace (most recent call first):\n");
-    for (int i = vm.frame_count - 1; i >= 0; i--) {
+    int last = vm.frame_count > STACKTRACE_FRAMES ? vm.frame_count - STACKTRACE_FRAMES : 0;
+    for (int i = vm.frame_count - 1; i >= last; i--) {
         CallFrame *frame = &vm.frames[i];
         int line = GetLine(&frame->closure->function->chunk, frame->ip - frame->closure->function->chunk.code - 1);
         
@@ -267,6 +456,9 @@ static void runtimeError(const char *message) {
         FPrintObj(stderr, (Obj*) frame->closure->function);
         fprintf(stderr, "\n");
     }
+    if (last > 0) {
+        fprintf(stderr, "[%d more calls]\n", last);
+    }
     
     while (vm.stack_top != vm.stack) {
         Pop();
@@ -275,8 +467,8 @@ static void runtimeError(const char *message) {
 }
 
 static void concatenate() {
-    Obj *right_string = peek(0).as.obj;
-    Obj *left_string = peek(1).as.obj;
+    Obj *right_string = AsObj(peek(0));
+    Obj *left_string = AsObj(peek(1));
     Obj *sum = Concatenate(left_string, right_string);
     Pop(); Pop();
     PUSH_OBJ(sum);
@@ -312,18 +504,46 @@ static ObjUpvalue *captureUpvalue(Value *slot) {
 static void closeUpvalues(Value *last) {
     while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last) {
         ObjUpvalue *upvalue = vm.open_upvalues; 
-        upvalue->closed = *upvalue->location;
+        // The variable moves from the stack to the heap, where it's counted.
+        upvalue->closed = *upvalue->location; IncrementRefcountValue(upvalue->closed);
         upvalue->location = &upvalue->closed;
+        WriteBarrier((Obj*) upvalue, upvalue->closed);
         vm.open_upvalues = upvalue->next;
     }
 }
 
-static void setFrameFunctionCall(int argc, ObjClosure *closure, CallFrame **framep) {
+// ensureLinked checks the code of a function of a bytecode image the first
+// time it's called. It may trigger a GC cycle.
+static bool ensureLinked(ObjFunction *function) {
+    if (!function->linked && !LinkFunction(function)) {
+        runtimeError("Invalid bytecode.");
+        return false;
+    }
+    return true;
+}
+
+static bool setFrameFunctionCall(int argc, ObjClosure *closure, CallFrame **framep) {
+        if (!ensureLinked(closure->function)) {
+            return false;
+        }
+        
+        if (vm.frame_count == vm.frame_capacity) {
+            vm.frame_capacity = GROW_CAPACITY(vm.frame_capacity);
+            vm.frames = realloc(vm.frames, vm.frame_capacity * sizeof(CallFrame));
+            if (vm.frames == NULL) {
+                fprintf(stderr, "Could not grow the call frames\n");
+                exit(1);
+            }
+        }
+        // The callee and its arguments are already on the stack.
+        reserveStack(closure->function->stack_size - (argc + 1) + STACK_SLACK);
+        
         *framep = &vm.frames[vm.frame_count++];
         (*framep)->closure = closure;
         (*framep)->ip = closure->function->chunk.code;
         (*framep)->slots = vm.stack_top - argc - 1;
-    
+        
+        return true;
 }
 
 static bool callNative(int argc, CallFrame **framep) {
@@ -348,8 +568,7 @@ static bool callNative(int argc, CallFrame **framep) {
 }
 
 static bool callClass(int argc, CallFrame **framep) {
-    Value called_value = peek(argc);
-    ObjClass *class = AS_CLASS(called_value);
+    ObjClass *class = AS_CLASS(peek(argc));
     Value init_val;
     if (Get(&class->methods, vm.init_string, &init_val)) { // "init" method
         ObjClosure *closure = AS_CLOSURE(init_val);
@@ -358,12 +577,17 @@ static bool callClass(int argc, CallFrame **framep) {
             return false;
         }
         
+        if (vm.frame_count == FRAMES_MAX) {
+            runtimeError("Stack overflow.");
+            return false;
+        }
+        
         Value instance = FromObj((Obj*) NewInstance(class));
         *(vm.stack_top - (argc + 1)) = instance;
-        IncrementRefcountValue(instance);
-        DecrementRefcountValue(called_value);
         
-        setFrameFunctionCall(argc, closure, framep);
+        if (!setFrameFunctionCall(argc, closure, framep)) {
+            return false;
+        }
     } else { // No "init" method
         if (argc != 0) {
             runtimeError("Default constructor takes no arguments.");
@@ -390,14 +614,11 @@ static bool callClosure(int argc, CallFrame **framep) {
         return false;
     }
     
-    setFrameFunctionCall(argc, closure, framep);
-    
-    return true;
+    return setFrameFunctionCall(argc, closure, framep);
 }
 
 static bool callBoundMethod(int argc, CallFrame **framep) {
-    Value called_value = peek(argc);
-    ObjBoundMethod *method = AS_BOUND_METHOD(called_value);    
+    ObjBoundMethod *method = AS_BOUND_METHOD(peek(argc));
     Value receiver = method->receiver;
     ObjClosure *closure = method->method;
     if (argc != closure->function->arity) {
@@ -411,12 +632,8 @@ static bool callBoundMethod(int argc, CallFrame **framep) {
     }
     
     *(vm.stack_top - (argc + 1)) = receiver;
-    IncrementRefcountValue(receiver);
-    DecrementRefcountValue(called_value);
-    
-    setFrameFunctionCall(argc, closure, framep);
     
-    return true;
+    return setFrameFunctionCall(argc, closure, framep);
 }
 
 static bool call(int argc,  CallFrame **framep) {
@@ -441,6 +658,50 @@ static bool call(int argc,  CallFrame **framep) {
     }
 }
 
+// reuseFrame runs closure, whose receiver or callee and arguments are at the
+// top of the stack, in the current frame instead of pushing a new one.
+static bool reuseFrame(int argc, ObjClosure *closure, CallFrame *frame) {
+    if (!ensureLinked(closure->function)) {
+        return false;
+    }
+    reserveStack((int) (frame->slots - vm.stack_top) + closure->function->stack_size + STACK_SLACK);
+    
+    // The locals of the caller are closed over before the callee and its
+    // arguments overwrite them.
+    closeUpvalues(frame->slots);
+    memmove(frame->slots, vm.stack_top - (argc + 1), (argc + 1) * sizeof(Value));
+    vm.stack_top = frame->slots + argc + 1;
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    
+    return true;
+}
+
+// tailCall calls the value below the arguments like call(), but a closure or
+// bound method reuses the frame of the function returning its result instead
+// of pushing a new one, so tail recursion runs in constant frame space. Other
+// callees, and calls with the wrong number of arguments, go through call(),
+// and the OP_RETURN after OP_TAIL_CALL returns their result.
+static bool tailCall(int argc, CallFrame **framep) {
+    Value called_value = peek(argc);
+    ObjClosure *closure;
+    if (IsClosure(called_value)) {
+        closure = AS_CLOSURE(called_value);
+    } else if (IsBoundMethod(called_value)) {
+        closure = AS_BOUND_METHOD(called_value)->method;
+    } else {
+        return call(argc, framep);
+    }
+    if (argc != closure->function->arity) {
+        return call(argc, framep);
+    }
+    
+    if (IsBoundMethod(called_value)) {
+        *(vm.stack_top - (argc + 1)) = AS_BOUND_METHOD(called_value)->receiver;
+    }
+    return reuseFrame(argc, closure, *framep);
+}
+
 static bool methodCall(int argc, ObjClosure *method, CallFrame **framep) {
     if (argc != method->function->arity) {
         runtimeError("Invalid number of arguments");
@@ -452,32 +713,330 @@ static bool methodCall(int argc, ObjClosure *method, CallFrame **framep) {
         return false;
     }
     
-    setFrameFunctionCall(argc, method, framep);
+    return setFrameFunctionCall(argc, method, framep);
+}
+
+typedef enum {
+    PROPERTY_NONE,
+    PROPERTY_FIELD,
+    PROPERTY_METHOD,
+} PropertyKind;
+
+static InlineCacheEntry *findCacheEntry(InlineCache *cache, ObjClass *class, Shape *shape) {
+    for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+        InlineCacheEntry *entry = &cache->entries[i];
+        if (entry->class == class && entry->shape == shape) {
+            return entry;
+        }
+    }
+    
+    return NULL;
+}
+
+// fillCache records the result of a property lookup on an instance of class
+// with the given shape. entry is the entry already associated with both, or
+// NULL if there's none.
+static void fillCache(InlineCache *cache, InlineCacheEntry *entry, ObjClass *class, Shape *shape, int field, Value method) {
+    if (entry == NULL) {
+        entry = &cache->entries[cache->next];
+        cache->next = (cache->next + 1) % INLINE_CACHE_WAYS;
+    }
     
-    return true;
+    // Take the new references before dropping the old ones, the evicted
+    // entry may hold the only other reference to them.
+    IncrementRefcountObject((Obj*) class);
+    IncrementRefcountShape(shape);
+    IncrementRefcountValue(method);
+    if (entry->class != NULL) {
+        DecrementRefcountObject((Obj*) entry->class);
+        DecrementRefcountShape(entry->shape);
+        DecrementRefcountValue(entry->method);
+    }
+    
+    entry->class = class;
+    entry->shape = shape;
+    entry->version = class->version;
+    entry->field = field;
+    entry->method = method;
+    
+    // Caches are only filled by the function that is running.
+    Obj *function = (Obj*) vm.frames[vm.frame_count - 1].closure->function;
+    WriteBarrier(function, FromObj((Obj*) class));
+    for (int i = 0; i < shape->count; i++) {
+        WriteBarrier(function, FromObj((Obj*) shape->names[i]));
+    }
+    WriteBarrier(function, method);
+}
+
+// lookupProperty finds property in the instance's fields or in its class'
+// methods, in that order, and stores it in value.
+//
+// Lookups on instances in shape mode are cached by class and shape: the shape
+// gives the slot of a field, and tells that a method isn't shadowed by a
+// field. Cached methods also remember the class version they were read at.
+static PropertyKind lookupProperty(ObjInstance *instance, ObjString *property, InlineCache *cache, Value *value) {
+    ObjClass *class = instance->class;
+    Shape *shape = instance->shape;
+    
+    InlineCacheEntry *entry = NULL;
+    if (shape != NULL) {
+        entry = findCacheEntry(cache, class, shape);
+        if (entry != NULL) {
+            if (entry->field >= 0) {
+                *value = instance->slots[entry->field];
+                return PROPERTY_FIELD;
+            }
+            if (entry->version == class->version) {
+                *value = entry->method;
+                return PROPERTY_METHOD;
+            }
+        }
+    }
+    
+    if (shape == NULL) {
+        if (Get(&instance->fields, property, value)) {
+            return PROPERTY_FIELD;
+        }
+    } else {
+        int field = ShapeSlot(shape, property);
+        if (field >= 0) {
+            fillCache(cache, entry, class, shape, field, FromNil());
+            *value = instance->slots[field];
+            return PROPERTY_FIELD;
+        }
+    }
+    
+    if (Get(&class->methods, property, value)) {
+        if (shape != NULL) {
+            fillCache(cache, entry, class, shape, -1, *value);
+        }
+        return PROPERTY_METHOD;
+    }
+    
+    return PROPERTY_NONE;
+}
+
+// getProperty replaces the instance at the top of the stack with the value of
+// its property.
+static bool getProperty(ObjString *property, InlineCache *cache) {
+    if (!IsInstance(peek(0))) {
+        runtimeError("Only instances have properties.");
+        return false;
+    }
+    
+    ObjInstance *instance = AS_INSTANCE(peek(0));
+    
+    Value value;
+    switch (lookupProperty(instance, property, cache, &value)) {
+        case PROPERTY_FIELD:
+            Pop(); // instance
+            Push(value);
+            return true;
+        case PROPERTY_METHOD: {
+            Value receiver = FromObj((Obj*) instance);
+            ObjBoundMethod *bound_method = NewBoundMethod(receiver, AS_CLOSURE(value));
+            Pop(); // instance
+            PUSH_OBJ(bound_method);
+            return true;
+        }
+        default:
+            runtimeError("Instance does not have field or method.");
+            return false;
+    }
+}
+
+// invoke calls the property of the instance below the arguments. When tail is
+// true, the call is in tail position (OP_TAIL_INVOKE) and a method reuses the
+// current frame, see tailCall().
+static bool invoke(ObjString *property, int argc, InlineCache *cache, bool tail, CallFrame **framep) {
+    if (!IsInstance(peek(argc))) {
+        runtimeError("Only instances have properties.");
+        return false;
+    }
+    
+    ObjInstance *instance = AS_INSTANCE(peek(argc));
+    
+    Value value;
+    switch (lookupProperty(instance, property, cache, &value)) {
+        case PROPERTY_FIELD:
+            *(vm.stack_top - (argc + 1)) = value;
+            return tail ? tailCall(argc, framep) : call(argc, framep);
+        case PROPERTY_METHOD: {
+            ObjClosure *method = AS_CLOSURE(value);
+            if (tail && argc == method->function->arity) {
+                return reuseFrame(argc, method, *framep);
+            }
+            return methodCall(argc, method, framep);
+        }
+        default:
+            runtimeError("Instance doesn't have property.");
+            return false;
+    }
 }
 
 static InterpretResult run() {
-    CallFrame *frame = &vm.frames[vm.frame_count - 1];
+    // The hot parts of the current frame live in locals so the compiler can
+    // keep them in registers. They are written back to the frame before
+    // anything that reads them from there (calls, runtime errors).
+    CallFrame *frame;
+    uint8_t *ip;
+    Value *slots;
+    Value *constants;
+    InlineCache *caches;
     
-#define READ_BYTE() (*frame->ip++)
+#define READ_BYTE() (*ip++)
 #define READ_SHORT() \
-    (frame->ip += 2, (int16_t) (frame->ip[-2] | (frame->ip[-1] << 8)))
-#define READ_CONSTANT(offset) (frame->closure->function->chunk.constants.values[(offset)])
-#define EXEC_NUM_BIN_OP(op, toValue) \
+    (ip += 2, (int16_t) (ip[-2] | (ip[-1] << 8)))
+#define READ_CONSTANT(offset) (constants[(offset)])
+#define READ_CACHE() \
+    (ip += 2, &caches[(uint16_t) (ip[-2] | (ip[-1] << 8))])
+#define READ_GLOBAL() \
+    (ip += 2, &vm.globals[(uint16_t) (ip[-2] | (ip[-1] << 8))])
+// Instructions push without checking for room, see reserveStack(). The
+// DEBUG build checks that calls reserved enough.
+#ifdef DEBUG
+#define PUSH(value) \
+    do { \
+        Value pushed = (value); \
+        assert(vm.stack_top < vm.stack_end); \
+        *vm.stack_top++ = pushed; \
+    } while (false)
+#else
+#define PUSH(value) \
+    do { \
+        Value pushed = (value); \
+        *vm.stack_top++ = pushed; \
+    } while (false)
+#endif
+#define STORE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME() \
+    do { \
+        frame = &vm.frames[vm.frame_count - 1]; \
+        ip = frame->ip; \
+        slots = frame->slots; \
+        constants = frame->closure->function->chunk.constants.values; \
+        caches = frame->closure->function->chunk.caches; \
+    } while (false)
+#define RUNTIME_ERROR(message) \
+    do { \
+        STORE_FRAME(); \
+        runtimeError(message); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+// QUICKEN rewrites the instruction being executed into op, which is either
+// a variant specialised for the operands just seen or, to deoptimise, the
+// generic instruction. Code still in a bytecode image isn't quickened, so
+// that it stays shared between the processes running the script. Images hold
+// no quickened instructions, so it's never deoptimised either.
+#define QUICKEN(op) \
+    do { \
+        if (!frame->closure->function->chunk.code_mapped) { \
+            ip[-1] = (op); \
+        } \
+    } while (false)
+// DEOPTIMIZE rewrites the instruction being executed back into the generic
+// op and moves ip back so that the next DISPATCH() executes it.
+#define DEOPTIMIZE(op) \
+    do { \
+        QUICKEN(op); \
+        ip--; \
+    } while (false)
+#define BOTH_NUMBERS() (IsNumber(peek(0)) && IsNumber(peek(1)))
+#define EXEC_NUM_BIN_OP(op, toValue, quick_op) \
     do { \
         Value right = peek(0); \
         Value left = peek(1); \
         if (!IsNumber(right) || !IsNumber(left)) { \
-            runtimeError("Operands must be numbers."); \
-            return INTERPRET_RUNTIME_ERROR; \
+            RUNTIME_ERROR("Operands must be numbers."); \
         } \
-        Value result = toValue(left.as.number op right.as.number); \
+        QUICKEN(quick_op); \
+        Value result = toValue(AsNumber(left) op AsNumber(right)); \
         Pop(); Pop(); \
-        Push(result); \
+        PUSH(result); \
+    } while (false)
+// Numbers and booleans aren't refcounted, so the quickened variants write
+// the result over the left operand instead of going through Pop() and Push().
+#define EXEC_QUICK_NUM_BIN_OP(op, toValue) \
+    do { \
+        double right = AsNumber(vm.stack_top[-1]); \
+        double left = AsNumber(vm.stack_top[-2]); \
+        vm.stack_top--; \
+        vm.stack_top[-1] = toValue(left op right); \
     } while (false)
 
-    int itn = 0;
+#ifdef COMPUTED_GOTO
+    // One label per opcode, indexed by the opcode. Each handler jumps straight
+    // to the handler of the next instruction, so every handler gets its own
+    // indirect branch (and its own branch predictor entry).
+    static void *dispatch_table[] = {
+        [OP_CONSTANT] = &&op_OP_CONSTANT,
+        [OP_CONSTANT_LONG] = &&op_OP_CONSTANT_LONG,
+        [OP_NIL] = &&op_OP_NIL,
+        [OP_TRUE] = &&op_OP_TRUE,
+        [OP_FALSE] = &&op_OP_FALSE,
+        [OP_NEGATE] = &&op_OP_NEGATE,
+        [OP_NOT] = &&op_OP_NOT,
+        [OP_EQ] = &&op_OP_EQ,
+        [OP_NEQ] = &&op_OP_NEQ,
+        [OP_LESS] = &&op_OP_LESS,
+        [OP_LESS_EQ] = &&op_OP_LESS_EQ,
+        [OP_GREATER] = &&op_OP_GREATER,
+        [OP_GREATER_EQ] = &&op_OP_GREATER_EQ,
+        [OP_ADD] = &&op_OP_ADD,
+        [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&op_OP_MULTIPLY,
+        [OP_DIVIDE] = &&op_OP_DIVIDE,
+        [OP_RETURN] = &&op_OP_RETURN,
+        [OP_POP] = &&op_OP_POP,
+        [OP_POPN] = &&op_OP_POPN,
+        [OP_VAR_DECL] = &&op_OP_VAR_DECL,
+        [OP_IDENT_GLOBAL] = &&op_OP_IDENT_GLOBAL,
+        [OP_ASSIGN_GLOBAL] = &&op_OP_ASSIGN_GLOBAL,
+        [OP_IDENT_LOCAL] = &&op_OP_IDENT_LOCAL,
+        [OP_ASSIGN_LOCAL] = &&op_OP_ASSIGN_LOCAL,
+        [OP_IDENT_PROPERTY] = &&op_OP_IDENT_PROPERTY,
+        [OP_IDENT_PROPERTY_LONG] = &&op_OP_IDENT_PROPERTY_LONG,
+        [OP_ASSIGN_PROPERTY] = &&op_OP_ASSIGN_PROPERTY,
+        [OP_IDENT_UPVALUE] = &&op_OP_IDENT_UPVALUE,
+        [OP_ASSIGN_UPVALUE] = &&op_OP_ASSIGN_UPVALUE,
+        [OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+        [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+        [OP_JUMP] = &&op_OP_JUMP,
+        [OP_JUMP_IF_TRUE] = &&op_OP_JUMP_IF_TRUE,
+        [OP_DUPLICATE] = &&op_OP_DUPLICATE,
+        [OP_CALL] = &&op_OP_CALL,
+        [OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+        [OP_INVOKE] = &&op_OP_INVOKE,
+        [OP_INVOKE_LONG] = &&op_OP_INVOKE_LONG,
+        [OP_TAIL_INVOKE] = &&op_OP_TAIL_INVOKE,
+        [OP_TAIL_INVOKE_LONG] = &&op_OP_TAIL_INVOKE_LONG,
+        [OP_CLOSURE] = &&op_OP_CLOSURE,
+        [OP_CLOSURE_LONG] = &&op_OP_CLOSURE_LONG,
+        [OP_METHOD] = &&op_OP_METHOD,
+        [OP_INHERIT] = &&op_OP_INHERIT,
+        [OP_GET_SUPER] = &&op_OP_GET_SUPER,
+        [OP_ADD_NUM] = &&op_OP_ADD_NUM,
+        [OP_SUBTRACT_NUM] = &&op_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY_NUM] = &&op_OP_MULTIPLY_NUM,
+        [OP_DIVIDE_NUM] = &&op_OP_DIVIDE_NUM,
+        [OP_LESS_NUM] = &&op_OP_LESS_NUM,
+        [OP_LESS_EQ_NUM] = &&op_OP_LESS_EQ_NUM,
+        [OP_GREATER_NUM] = &&op_OP_GREATER_NUM,
+        [OP_GREATER_EQ_NUM] = &&op_OP_GREATER_EQ_NUM,
+    };
+    
+#define CASE(op) op_##op
+#define DISPATCH() goto *dispatch_table[READ_BYTE()]
+#else
+#define CASE(op) case op
+#define DISPATCH() break
+#endif
+
+    LOAD_FRAME();
+    
+#ifdef COMPUTED_GOTO
+    DISPATCH();
+#else
     for (;;) {
         
 #ifdef DEBUG
@@ -488,402 +1047,510 @@ static InterpretResult run() {
             printf(" ]");
         }
         printf("\n");
-        DisassembleInstruction(&frame->closure->function->chunk, (int) (frame->ip - frame->closure->function->chunk.code));
+        DisassembleInstruction(&frame->closure->function->chunk, (int) (ip - frame->closure->function->chunk.code));
 #endif
 
-        Value right, left;
         uint8_t instruction = READ_BYTE();
         switch (instruction) {
-            case OP_CONSTANT: {
+#endif
+            CASE(OP_CONSTANT): {
                 size_t offset = READ_BYTE();
-                Push(READ_CONSTANT(offset));
-                break;
+                PUSH(READ_CONSTANT(offset));
+                DISPATCH();
             }
-            case OP_CONSTANT_LONG: {
+            CASE(OP_CONSTANT_LONG): {
                 size_t offset = 0;
                 for (size_t i = 0, pot = 1; i < 3; i++, pot = (pot << 8)) {
                     offset += READ_BYTE() * pot;
                 }
-                Push(READ_CONSTANT(offset));
-                break;
-            }
-            case OP_NIL:
-                Push(FromNil());
-                break;
-            case OP_TRUE:
-                Push(FromBoolean(true));
-                break;
-            case OP_FALSE:
-                Push(FromBoolean(false));
-                break;
-            case OP_NEGATE: {
+                PUSH(READ_CONSTANT(offset));
+                DISPATCH();
+            }
+            CASE(OP_NIL):
+                PUSH(FromNil());
+                DISPATCH();
+            CASE(OP_TRUE):
+                PUSH(FromBoolean(true));
+                DISPATCH();
+            CASE(OP_FALSE):
+                PUSH(FromBoolean(false));
+                DISPATCH();
+            CASE(OP_NEGATE): {
                 if (!IsNumber(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Operand must be a number.");
                 }
-                double d = -peek(0).as.number; Pop();
-                Push(FromDouble(d));
+                double d = -AsNumber(peek(0)); Pop();
+                PUSH(FromDouble(d));
                 
-                break;
+                DISPATCH();
             }
-            case OP_NOT: {
+            CASE(OP_NOT): {
                 bool res = !IsTruthy(peek(0)); Pop();
-                Push(FromBoolean(res));
-                break;
+                PUSH(FromBoolean(res));
+                DISPATCH();
             }
-            case OP_EQ: {
+            CASE(OP_EQ): {
                 bool res = ValuesEqual(peek(0), peek(1)); Pop(); Pop();
-                Push(FromBoolean(res));
-                break;
+                PUSH(FromBoolean(res));
+                DISPATCH();
             }
-            case OP_NEQ: {
+            CASE(OP_NEQ): {
                 bool res = !ValuesEqual(peek(0), peek(1)); Pop(); Pop();
-                Push(FromBoolean(res));
-                break;
-            }
-            case OP_LESS:
-                EXEC_NUM_BIN_OP(<, FromBoolean);
-                break;
-            case OP_LESS_EQ:
-                EXEC_NUM_BIN_OP(<=, FromBoolean);
-                break;
-            case OP_GREATER:
-                EXEC_NUM_BIN_OP(>, FromBoolean);
-                break;
-            case OP_GREATER_EQ:
-                EXEC_NUM_BIN_OP(>=, FromBoolean);
-                break;
-            case OP_ADD:
+                PUSH(FromBoolean(res));
+                DISPATCH();
+            }
+            CASE(OP_LESS):
+                EXEC_NUM_BIN_OP(<, FromBoolean, OP_LESS_NUM);
+                DISPATCH();
+            CASE(OP_LESS_EQ):
+                EXEC_NUM_BIN_OP(<=, FromBoolean, OP_LESS_EQ_NUM);
+                DISPATCH();
+            CASE(OP_GREATER):
+                EXEC_NUM_BIN_OP(>, FromBoolean, OP_GREATER_NUM);
+                DISPATCH();
+            CASE(OP_GREATER_EQ):
+                EXEC_NUM_BIN_OP(>=, FromBoolean, OP_GREATER_EQ_NUM);
+                DISPATCH();
+            CASE(OP_ADD):
                 if (IsString(peek(0)) && IsString(peek(1))) {
                     concatenate();
-                    break;
+                    DISPATCH();
                 }
-                if (IsNumber(peek(0)) && IsNumber(peek(1))) {
-                    Value result = FromDouble(peek(0).as.number + peek(1).as.number);
+                if (BOTH_NUMBERS()) {
+                    QUICKEN(OP_ADD_NUM);
+                    Value result = FromDouble(AsNumber(peek(1)) + AsNumber(peek(0)));
                     Pop(); Pop();
-                    Push(result);
-                    break;
-                }
-                runtimeError("Operands must be two strings or two numbers.");
-                return INTERPRET_RUNTIME_ERROR;
-            case OP_SUBTRACT:
-                EXEC_NUM_BIN_OP(-, FromDouble);
-                break;
-            case OP_MULTIPLY:
-                EXEC_NUM_BIN_OP(*, FromDouble);
-                break;
-            case OP_DIVIDE:
-                EXEC_NUM_BIN_OP(/, FromDouble);
-                break;
-            case OP_POP:
-                Pop();
-                break;
-            case OP_POPN: {
-                uint8_t n = READ_BYTE();
-                for (uint8_t i = 0; i < n; i++) {
-                    Pop();
+                    PUSH(result);
+                    DISPATCH();
                 }
-                break;
-            }
-            case OP_VAR_DECL: {
-                // The call to Insert() might trigger a GC cycle. If 'right' and 'left' are not on the stack, the GC might collect them.
-                right = peek(0); // value
-                left = peek(1); // variable
-                if (!Insert(&vm.globals, AS_STRING(left), right)) {
-                    runtimeError("Already a global variable with this name.");
-                    return INTERPRET_RUNTIME_ERROR;
+                RUNTIME_ERROR("Operands must be two strings or two numbers.");
+            CASE(OP_SUBTRACT):
+                EXEC_NUM_BIN_OP(-, FromDouble, OP_SUBTRACT_NUM);
+                DISPATCH();
+            CASE(OP_MULTIPLY):
+                EXEC_NUM_BIN_OP(*, FromDouble, OP_MULTIPLY_NUM);
+                DISPATCH();
+            CASE(OP_DIVIDE):
+                EXEC_NUM_BIN_OP(/, FromDouble, OP_DIVIDE_NUM);
+                DISPATCH();
+            CASE(OP_ADD_NUM):
+                if (!BOTH_NUMBERS()) {
+                    DEOPTIMIZE(OP_ADD);
+                    DISPATCH();
+                }
+                EXEC_QUICK_NUM_BIN_OP(+, FromDouble);
+                DISPATCH();
+            CASE(OP_SUBTRACT_NUM):
+                if (!BOTH_NUMBERS()) {
+                    DEOPTIMIZE(OP_SUBTRACT);
+                    DISPATCH();
+                }
+                EXEC_QUICK_NUM_BIN_OP(-, FromDouble);
+                DISPATCH();
+            CASE(OP_MULTIPLY_NUM):
+                if (!BOTH_NUMBERS()) {
+                    DEOPTIMIZE(OP_MULTIPLY);
+                    DISPATCH();
+                }
+                EXEC_QUICK_NUM_BIN_OP(*, FromDouble);
+                DISPATCH();
+            CASE(OP_DIVIDE_NUM):
+                if (!BOTH_NUMBERS()) {
+                    DEOPTIMIZE(OP_DIVIDE);
+                    DISPATCH();
+                }
+                EXEC_QUICK_NUM_BIN_OP(/, FromDouble);
+                DISPATCH();
+            CASE(OP_LESS_NUM):
+                if (!BOTH_NUMBERS()) {
+                    DEOPTIMIZE(OP_LESS);
+                    DISPATCH();
                 }
+                EXEC_QUICK_NUM_BIN_OP(<, FromBoolean);
+                DISPATCH();
+            CASE(OP_LESS_EQ_NUM):
+                if (!BOTH_NUMBERS()) {
+                    DEOPTIMIZE(OP_LESS_EQ);
+                    DISPATCH();
+                }
+                EXEC_QUICK_NUM_BIN_OP(<=, FromBoolean);
+                DISPATCH();
+            CASE(OP_GREATER_NUM):
+                if (!BOTH_NUMBERS()) {
+                    DEOPTIMIZE(OP_GREATER);
+                    DISPATCH();
+                }
+                EXEC_QUICK_NUM_BIN_OP(>, FromBoolean);
+                DISPATCH();
+            CASE(OP_GREATER_EQ_NUM):
+                if (!BOTH_NUMBERS()) {
+                    DEOPTIMIZE(OP_GREATER_EQ);
+                    DISPATCH();
+                }
+                EXEC_QUICK_NUM_BIN_OP(>=, FromBoolean);
+                DISPATCH();
+            CASE(OP_POP):
                 Pop();
+                DISPATCH();
+            CASE(OP_POPN):
+                vm.stack_top -= READ_BYTE();
+                DISPATCH();
+            CASE(OP_VAR_DECL): {
+                GlobalVar *global = READ_GLOBAL();
+                if (global->defined) {
+                    RUNTIME_ERROR("Already a global variable with this name.");
+                }
+                global->value = peek(0); IncrementRefcountValue(global->value);
+                global->defined = true;
                 Pop();
                 
-                break;
+                DISPATCH();
             }
-            case OP_IDENT_GLOBAL: {
-                Value value;
-                if (Get(&vm.globals, AS_STRING(peek(0)), &value)) {
-                    Pop();
-                    Push(value);
-                    break;
+            CASE(OP_IDENT_GLOBAL): {
+                GlobalVar *global = READ_GLOBAL();
+                if (!global->defined) {
+                    RUNTIME_ERROR("Undefined identifier.");
                 }
-                runtimeError("Undefined identifier.");
-                return INTERPRET_RUNTIME_ERROR;
+                PUSH(global->value);
+                DISPATCH();
             }
-            case OP_ASSIGN_GLOBAL: {
-                Value value = peek(0);
-                if (Insert(&vm.globals, AS_STRING(peek(1)), peek(0))) {
-                   runtimeError("Undefined variable.");
-                   return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_ASSIGN_GLOBAL): {
+                GlobalVar *global = READ_GLOBAL();
+                if (!global->defined) {
+                    RUNTIME_ERROR("Undefined variable.");
                 }
-                Pop();
-                Pop();
-                Push(value);
+                // The value stays on the stack, assignment is an expression.
+                Value old = global->value;
+                global->value = peek(0); IncrementRefcountValue(global->value);
+                DecrementRefcountValue(old);
                 
-                break;
+                DISPATCH();
             }
-            case OP_IDENT_LOCAL: {
+            CASE(OP_IDENT_LOCAL): {
                 uint8_t i = READ_BYTE();
-                Push(frame->slots[i]);
-                break;
+                PUSH(slots[i]);
+                DISPATCH();
             }
-            case OP_ASSIGN_LOCAL: {
+            CASE(OP_ASSIGN_LOCAL): {
                 uint8_t i = READ_BYTE();
-                DecrementRefcountValue(frame->slots[i]);
-                frame->slots[i] = peek(0);
-                IncrementRefcountValue(frame->slots[i]);
-                break;
+                slots[i] = peek(0);
+                DISPATCH();
             }
-            case OP_IDENT_UPVALUE: {
+            CASE(OP_IDENT_UPVALUE): {
                 uint8_t index = READ_BYTE();
-                Push(*frame->closure->upvalues[index]->location);
-                break;
+                PUSH(*frame->closure->upvalues[index]->location);
+                DISPATCH();
             }
-            case OP_ASSIGN_UPVALUE: {
+            CASE(OP_ASSIGN_UPVALUE): {
                 uint8_t index = READ_BYTE();
-                Value *value = frame->closure->upvalues[index]->location;
-                DecrementRefcountValue(*value);
-                *value = peek(0); 
-                IncrementRefcountValue(*value);
+                ObjUpvalue *upvalue = frame->closure->upvalues[index];
+                if (upvalue->location != &upvalue->closed) {
+                    // Open upvalue, the variable is an uncounted stack slot.
+                    *upvalue->location = peek(0);
+                    DISPATCH();
+                }
+                Value old = upvalue->closed;
+                upvalue->closed = peek(0); IncrementRefcountValue(upvalue->closed);
+                DecrementRefcountValue(old);
+                WriteBarrier((Obj*) upvalue, upvalue->closed);
                 
-                break;
+                DISPATCH();
             }
-            case OP_CLOSE_UPVALUE:
+            CASE(OP_CLOSE_UPVALUE):
                 closeUpvalues(vm.stack_top - 1);
                 Pop();
-                break;
-            case OP_JUMP_IF_FALSE: {
+                DISPATCH();
+            CASE(OP_JUMP_IF_FALSE): {
                 int16_t n = READ_SHORT();
                 if (!IsTruthy(peek(0))) {
-                    frame->ip += n;
+                    ip += n;
+                }
+                DISPATCH();
+            }
+            CASE(OP_JUMP): {
+                int16_t n = READ_SHORT();
+                ip += n;
+                DISPATCH();
+            }
+            CASE(OP_JUMP_IF_TRUE): {
+                int16_t n = READ_SHORT();
+                if (IsTruthy(peek(0))) {
+                    ip += n;
                 }
-                break;
+                DISPATCH();
             }
-            case OP_JUMP:
-                frame->ip += READ_SHORT();
-                break;
-            case OP_DUPLICATE:
-                Push(peek(0));
-                break;
-            case OP_CALL: {
+            CASE(OP_DUPLICATE):
+                PUSH(peek(0));
+                DISPATCH();
+            CASE(OP_CALL): {
                 uint8_t argc = READ_BYTE();
+                STORE_FRAME();
                 if (!call(argc,  &frame)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                LOAD_FRAME();
+                DISPATCH();
             }
-            case OP_INVOKE: {
+            CASE(OP_TAIL_CALL): {
+                uint8_t argc = READ_BYTE();
+                STORE_FRAME();
+                if (!tailCall(argc, &frame)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                DISPATCH();
+            }
+            CASE(OP_INVOKE): {
                 size_t offset = READ_BYTE();
                 ObjString *property = AS_STRING(READ_CONSTANT(offset));
+                uint8_t argc = READ_BYTE(); 
+                InlineCache *cache = READ_CACHE();
                 
+                STORE_FRAME();
+                if (!invoke(property, argc, cache, false, &frame)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                DISPATCH(); 
+            }
+            CASE(OP_INVOKE_LONG): {
+                size_t offset = 0;
+                for (size_t i = 0, pot = 1; i < 3; i++, pot = (pot << 8)) {
+                    offset += READ_BYTE() * pot;
+                }
+                ObjString *property = AS_STRING(READ_CONSTANT(offset));
                 uint8_t argc = READ_BYTE(); 
-                if (!IsInstance(peek(argc))) {
-                    runtimeError("Only instances have properties.");
+                InlineCache *cache = READ_CACHE();
+                
+                STORE_FRAME();
+                if (!invoke(property, argc, cache, false, &frame)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                LOAD_FRAME();
+                DISPATCH(); 
+            }
+            CASE(OP_TAIL_INVOKE): {
+                size_t offset = READ_BYTE();
+                ObjString *property = AS_STRING(READ_CONSTANT(offset));
+                uint8_t argc = READ_BYTE(); 
+                InlineCache *cache = READ_CACHE();
                 
-                ObjInstance *instance = AS_INSTANCE(peek(argc));
+                STORE_FRAME();
+                if (!invoke(property, argc, cache, true, &frame)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                DISPATCH(); 
+            }
+            CASE(OP_TAIL_INVOKE_LONG): {
+                size_t offset = 0;
+                for (size_t i = 0, pot = 1; i < 3; i++, pot = (pot << 8)) {
+                    offset += READ_BYTE() * pot;
+                }
+                ObjString *property = AS_STRING(READ_CONSTANT(offset));
+                uint8_t argc = READ_BYTE(); 
+                InlineCache *cache = READ_CACHE();
                 
-                Value value;
-                if (Get(&instance->fields, property, &value)) {
-                    *(vm.stack_top - (argc + 1)) = value;
-                    IncrementRefcountValue(value); 
-                    DecrementRefcountObject((Obj*) instance); 
-                    if (!call(argc, &frame)) {
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-                } else if (Get(&instance->class->methods, property, &value)) {
-                    if (!methodCall(argc, AS_CLOSURE(value), &frame)) {
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-                } else {
-                    runtimeError("Instance doesn't have property.");
+                STORE_FRAME();
+                if (!invoke(property, argc, cache, true, &frame)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break; 
+                LOAD_FRAME();
+                DISPATCH(); 
             }
-            case OP_CLOSURE: {
+            CASE(OP_CLOSURE): {
                 size_t offset = READ_BYTE();
                 ObjFunction *function = AS_FUNCTION(READ_CONSTANT(offset));
                 ObjClosure *closure = NewClosure(function);
-                Push(FromObj((Obj*) closure));
+                PUSH(FromObj((Obj*) closure));
                 for (int i = 0; i < closure->upvalue_count; i++) {
                     uint8_t is_local = READ_BYTE();
                     uint8_t index = READ_BYTE();
                     if (is_local) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                        closure->upvalues[i] = captureUpvalue(slots + index);
                     } else {
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
                     IncrementRefcountObject((Obj*) closure->upvalues[i]);
+                    // captureUpvalue() may trigger a GC cycle that promotes the closure.
+                    WriteBarrier((Obj*) closure, FromObj((Obj*) closure->upvalues[i]));
                 }
                 
-                break;
+                DISPATCH();
             }
-            case OP_CLOSURE_LONG: {
+            CASE(OP_CLOSURE_LONG): {
                 size_t offset = 0;
                 for (size_t i = 0, pot = 1; i < 3; i++, pot = (pot << 8)) {
                     offset += READ_BYTE() * pot;
                 }
                 ObjFunction *function = AS_FUNCTION(READ_CONSTANT(offset));
                 ObjClosure *closure = NewClosure(function);
-                Push(FromObj((Obj*) closure));
+                PUSH(FromObj((Obj*) closure));
                 for (int i = 0; i < closure->upvalue_count; i++) {
                     uint8_t is_local = READ_BYTE();
                     uint8_t index = READ_BYTE();
                     if (is_local) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                        closure->upvalues[i] = captureUpvalue(slots + index);
                     } else {
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
                     IncrementRefcountObject((Obj*) closure->upvalues[i]);
+                    // captureUpvalue() may trigger a GC cycle that promotes the closure.
+                    WriteBarrier((Obj*) closure, FromObj((Obj*) closure->upvalues[i]));
                 }
                 
-                break;
+                DISPATCH();
             }
-            case OP_IDENT_PROPERTY: {
-                if (!IsInstance(peek(1))) {
-                    runtimeError("Only instances have properties.");
+            CASE(OP_IDENT_PROPERTY): {
+                size_t offset = READ_BYTE();
+                ObjString *property = AS_STRING(READ_CONSTANT(offset));
+                InlineCache *cache = READ_CACHE();
+                
+                STORE_FRAME();
+                if (!getProperty(property, cache)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                DISPATCH();
+            }
+            CASE(OP_IDENT_PROPERTY_LONG): {
+                size_t offset = 0;
+                for (size_t i = 0, pot = 1; i < 3; i++, pot = (pot << 8)) {
+                    offset += READ_BYTE() * pot;
+                }
+                ObjString *property = AS_STRING(READ_CONSTANT(offset));
+                InlineCache *cache = READ_CACHE();
                 
-                ObjInstance *instance = AS_INSTANCE(peek(1));
-                ObjString *field = AS_STRING(peek(0));
-                
-                Value value;
-                if (Get(&instance->fields, field, &value)) {
-                    // When we pop the instance from the stack, the instance
-                    // refcount might drop to 0. If that happens, the field we are
-                    // accessing could be collected. To prevent that, we increment
-                    // the field's refcount first.
-                    IncrementRefcountValue(value);
-                    
-                    Pop(); // field
-                    Pop(); // instance
-                    Push(value);
-                    
-                    // Now that it's in the stack, we can decrement the refcount.
-                    DecrementRefcountValue(value);
-                } else if (Get(&instance->class->methods, field, &value)) {
-                    Value receiver = FromObj((Obj*) instance);
-                    ObjClosure *method = AS_CLOSURE(value);
-                    ObjBoundMethod *bound_method = NewBoundMethod(receiver, method);
-                    value = FromObj((Obj*) bound_method);
-                    
-                    // Since NewBoundMethod() adds to the instance refcount, the
-                    // instance refcount won't drop to 0 when we pop instance
-                    // from the stack. So the GC won't be triggered and there is
-                    // no risk of bound_method being collected before we push it
-                    // onto the stack.
-                    Pop(); // field
-                    Pop(); // instance
-                    Push(value);
-                } else {
-                    runtimeError("Instance does not have field or method.");
+                STORE_FRAME();
+                if (!getProperty(property, cache)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                
-                break;
+                DISPATCH();
             }
-            case OP_ASSIGN_PROPERTY: {
+            CASE(OP_ASSIGN_PROPERTY): {
                 if (!IsInstance(peek(2))) {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Only instances have properties.");
                 }
                 
                 ObjInstance *instance = AS_INSTANCE(peek(2));
                 ObjString *field = AS_STRING(peek(1));
-                Value value = peek(0); IncrementRefcountValue(value);
+                Value value = peek(0);
                 
-                Insert(&instance->fields, field, value);
+                SetField(instance, field, value);
                 
                 Pop(); // value
                 Pop(); // field
                 Pop(); // instance
-                Push(value); DecrementRefcountValue(value);
+                PUSH(value);
                 
-                break;
+                DISPATCH();
             }
-            case OP_METHOD: {
+            CASE(OP_METHOD): {
                 Value closure = peek(0);
                 ObjString *name = AS_STRING(peek(1));
                 ObjClass *class = AS_CLASS(peek(2));
                 
                 Insert(&class->methods, name, closure);
+                WriteBarrier((Obj*) class, FromObj((Obj*) name));
+                WriteBarrier((Obj*) class, closure);
+                class->version++;
                 
                 Pop(); // closure
                 Pop(); // name
                 
-                break; 
+                DISPATCH(); 
             }
-            case OP_INHERIT: {
+            CASE(OP_INHERIT): {
                 Value value = peek(1);
                 if (!IsClass(value)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Superclass must be a class.");
                 }
                 
                 ObjClass *super = AS_CLASS(value);
                 ObjClass *sub = AS_CLASS(peek(0));
                 
                 CopyTable(&super->methods, &sub->methods);
+                Remember((Obj*) sub);
+                ShadeObj((Obj*) super); // Its methods are now referenced by sub
+                sub->version++;
                 
                 Pop(); // sub
                 
-                break;
+                DISPATCH();
             }
-            case OP_GET_SUPER: {
+            CASE(OP_GET_SUPER): {
                 ObjString *name = AS_STRING(peek(2));
                 ObjClass *superclass = AS_CLASS(peek(0));
                 
                 Value method;
                 if (!Get(&superclass->methods, name, &method)) {
-                    runtimeError("Undefined property.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Undefined property.");
                 }
                 
                 ObjBoundMethod *bound_method = NewBoundMethod(peek(1), AS_CLOSURE(method));
-                IncrementRefcountObject((Obj*) bound_method);
                 
                 Pop(); // superclass
                 Pop(); // instance
                 Pop(); // name
                 PUSH_OBJ(bound_method);
-                DecrementRefcountObject((Obj*) bound_method);
                 
-                break;
+                DISPATCH();
             }
-            case OP_RETURN: {
-                Value v = peek(0); IncrementRefcountValue(v); Pop();
-                closeUpvalues(frame->slots);
+            CASE(OP_RETURN): {
+                Value v = Pop();
+                closeUpvalues(slots);
                 
                 vm.frame_count--;
                 if (vm.frame_count == 0) {
-                    DecrementRefcountValue(v);
                     Pop();
                     return INTERPRET_OK;
                 }
                 
-                while (vm.stack_top != frame->slots) {
-                    Pop();
-                }
-                Push(v); DecrementRefcountValue(v);
+                vm.stack_top = slots;
+                PUSH(v);
                 
-                frame = &vm.frames[vm.frame_count - 1];
+                LOAD_FRAME();
                 
-                break;
+                DISPATCH();
             }
+#ifndef COMPUTED_GOTO
         }
     }
+#endif
 
+#undef DISPATCH
+#undef CASE
+#undef EXEC_QUICK_NUM_BIN_OP
 #undef EXEC_NUM_BIN_OP
+#undef BOTH_NUMBERS
+#undef DEOPTIMIZE
+#undef QUICKEN
+#undef RUNTIME_ERROR
+#undef LOAD_FRAME
+#undef STORE_FRAME
+#undef PUSH
 #undef READ_SHORT
 #undef READ_BYTE
+#undef READ_CACHE
+#undef READ_GLOBAL
 #undef READ_CONSTANT
 }
+
 InterpretResult Interpret(const char *source) {
-    ObjFunction *script = Compile(source);
+    return InterpretCached(source, NULL);
+}
+
+InterpretResult InterpretCached(const char *source, const char *cache_path) {
+    ObjFunction *script = cache_path != NULL ? ReadBytecode(cache_path, source) : NULL;
     if (script == NULL) {
-        FreeObj((Obj*) script);
-        return INTERPRET_COMPILE_ERROR;
+        script = Compile(source);
+        if (script == NULL) {
+            return INTERPRET_COMPILE_ERROR;
+        }
+        
+        if (cache_path != NULL) {
+            // Failing to write the cache only means the next run compiles again.
+            WriteBytecode(cache_path, script, source);
+        }
     }
     
     PUSH_OBJ(script); // NewClosure() may trigger a GC cycle
@@ -891,6 +1558,7 @@ InterpretResult Interpret(const char *source) {
     Pop(); // script
     Push(FromObj((Obj*) closure));
     DecrementRefcountObject((Obj*) script); // Compile() returns script with refcount = 1
+    reserveStack(script->stack_size - 1 + STACK_SLACK);
     
     CallFrame *frame = &vm.frames[vm.frame_count++];
     frame->closure = closure;
@@ -898,6 +1566,7 @@ InterpretResult Interpret(const char *source) {
     frame->slots = vm.stack;
     
     InterpretResult result = run();
+    FlushOutput(&vm.out);
     
     return result;
 }
@@ -5,8 +5,11 @@
 #include "object.h"
 #include "table.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Maximum depth of calls, past which a call fails with a stack overflow.
+// The frames and the stack grow on demand up to it.
+#ifndef FRAMES_MAX
+#define FRAMES_MAX (64 * 1024)
+#endif
 
 typedef struct {
   ObjClosure *closure;
@@ -14,25 +17,92 @@ typedef struct {
   Value *slots;
 } CallFrame;
 
+// GlobalVar is a global variable, stored in the slot that the compiler
+// resolved its name to.
 typedef struct {
-  CallFrame frames[FRAMES_MAX];
+  ObjString *name;
+  Value value;
+  bool defined; // false until the declaration of the variable is executed
+  // Whether the last successful compilation declaring the variable declared it
+  // const, so that later compilations (REPL lines) can't reassign it.
+  bool is_const;
+} GlobalVar;
+
+// With INCREMENTAL_GC, major collections mark the heap in slices interleaved
+// with the mutator, see StartIncrementalGarbage().
+typedef enum {
+  GC_IDLE,
+  GC_MARKING,
+} GCPhase;
+
+typedef struct {
+  CallFrame *frames;
   int frame_count;
+  int frame_capacity;
   
-  Value stack[STACK_MAX];
+  // The stack moves when it grows, see reserveStack(). Frames and open
+  // upvalues pointing into it are moved along.
+  Value *stack;
   Value *stack_top;
+  Value *stack_end;
+  
+  StringSet strings;
   
-  Table strings;
-  Table globals;
+  // Global variables, indexed by slot. global_slots maps their names to their slots.
+  Table global_slots;
+  GlobalVar *globals;
+  int global_count;
+  int global_capacity;
   
   ObjUpvalue *open_upvalues;
   
+  // Root of the tree of instance shapes, the shape of instances without fields.
+  Shape *root_shape;
+  
   // To avoid creating a "init" string every time we instantiate a class.
   ObjString *init_string; 
   
+  // Bytecode image the script was loaded from, or NULL, see ReadBytecode().
+  void *image;
+  size_t image_size;
+  // image_slots[i] is the slot in vm.globals of the global the code of the
+  // image refers to with slot i, see LinkFunction().
+  int *image_slots;
+  int image_slot_count;
+  
+  // Buffered standard output of the script, see the print() and flush() natives.
+  // It's flushed when the script finishes or fails, and after every line when
+  // the standard output is a terminal.
+  Output out;
+  
+  // Zero count table of the deferred reference counting, see ReconcileRefcounts().
+  Obj **zct;
+  int zct_count;
+  int zct_capacity;
+  int next_reconcile; // Refcounts will be reconciled when zct_count > next_reconcile
+  
   // GC data structures
+  GCPhase gc_phase;
+  size_t next_gc_slice; // Next marking slice will run when bytes_allocated > next_gc_slice
   size_t bytes_allocated;
   size_t next_gc; // Next GC cycle will be triggered when bytes_allocated > next_gc
-  Obj *objects;
+  
+  // Young generation, see CollectYoungGarbage().
+  size_t young_bytes; // Bytes allocated for young objects since the last collection
+  Obj **remembered; // Old objects that may reference young objects
+  int remembered_count;
+  int remembered_capacity;
+  bool collecting_young;
+  
+  // Pause times of the collector, in microseconds. Only the marking slices
+  // try to stay within GC_PAUSE_BUDGET_US, so they are also counted apart.
+  int gc_pause_count;
+  double gc_pause_total;
+  double gc_pause_max;
+  int gc_slices_over_budget;
+  double gc_slice_max;
+  double gc_sweep_max; // Sweeps end major collections, they aren't sliced
+  
   Obj **grey_objects;
   int grey_count;
   int grey_capacity;
@@ -51,6 +121,14 @@ void FreeVM();
 void Push(Value value);
 Value Pop();
 
+// GlobalSlot returns the slot of the global variable with the given name,
+// creating an undefined one if there's no such variable yet.
+int GlobalSlot(ObjString *name);
+
 InterpretResult Interpret(const char *source);
+// InterpretCached is like Interpret, but it loads the compiled script from the
+// bytecode file at cache_path if it is up to date with source, and writes it
+// there otherwise. cache_path may be NULL, to neither read nor write a file.
+InterpretResult InterpretCached(const char *source, const char *cache_path);
 
 #endif
@@ -0,0 +1,56 @@
+#!/bin/sh
+# Runs the scripts in tests/ with clox, and compares what they print with the
+# "// expect: " comments in them, in order. Lines of "// expect error: " must
+# appear in what clox prints to stderr; without them the script must succeed.
+# Scripts are run twice, compiled and then from their .loxc cache. Scripts
+# named *.repl.lox are instead fed to the REPL line by line, each line being
+# compiled on its own.
+
+clox=${1:-./clox}
+dir=$(dirname "$0")
+out=$(mktemp)
+err=$(mktemp)
+failed=0
+
+for test in "$dir"/*.lox; do
+  rm -f "${test}c"
+  case "$test" in
+    *.repl.lox) runs="repl" ;;
+    *) runs="compiled cached" ;;
+  esac
+  
+  for run in $runs; do
+    if [ "$run" = repl ]; then
+      "$clox" < "$test" 2> "$err" | sed -e 's/^\(> \)*//' | grep -v '^$' > "$out"
+      status=0
+    else
+      "$clox" "$test" > "$out" 2> "$err"
+      status=$?
+    fi
+    
+    ok=1
+    if ! sed -n 's|.*// expect: ||p' "$test" | diff - "$out" > /dev/null; then
+      ok=0
+    fi
+    sed -n 's|.*// expect error: ||p' "$test" > "$out.errors"
+    if [ -s "$out.errors" ]; then
+      while read -r line; do
+        grep -qF -- "$line" "$err" || ok=0
+      done < "$out.errors"
+    elif [ $status -ne 0 ]; then
+      ok=0
+    fi
+    
+    if [ $ok -eq 0 ]; then
+      echo "FAIL $test ($run)"
+      failed=1
+    fi
+  done
+  rm -f "${test}c"
+done
+
+rm -f "$out" "$out.errors" "$err"
+if [ $failed -eq 0 ]; then
+  echo "All tests passed."
+fi
+exit $failed